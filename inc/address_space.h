@@ -0,0 +1,76 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//-- Maximum of free ranges remembered for reuse, VA of the range which doesn't fit is lost
+#define AS_MAX_FREE_EXTENTS 256
+
+//-- What kind of span starts at the owner address
+typedef enum ESpanKind
+{
+    SK_None = 0,
+    SK_Slab = 1,
+    SK_BTHeap = 2
+} SpanKind;
+
+typedef struct SSpanExtent
+{
+    size_t m_offset;
+    size_t m_size;
+} SpanExtent;
+
+//-- One reserved (PROT_NONE) virtual range, spans are committed inside it on demand.
+//-- Every page has an entry in m_pageMap: (index of the first page of its span + 1) << 2 | kind.
+//-- Commit, decommit and extend take m_lock, lookups are lock free
+typedef struct SAddressSpace
+{
+    unsigned char*     m_base;
+    size_t             m_size;      /* reserved bytes */
+    _Atomic(size_t)    m_top;       /* bytes from m_base ever handed out */
+    size_t             m_committed; /* bytes currently committed and not discarded */
+    size_t             m_limit;     /* commits over it fail, 0 - no limit */
+    _Atomic(uint64_t)* m_pageMap;
+    SpanExtent         m_freeExtents[AS_MAX_FREE_EXTENTS]; /* sorted by offset */
+    int                m_freeExtentsCount;
+    bool               m_fileBacked; /* shared file mapping: pages are removed from file, range stays accessible */
+    pthread_mutex_t    m_lock;
+} AddressSpace;
+
+// Reserves the range, size is halved until reservation succeeds (but not below 1 GiB)
+bool spaceInit(AddressSpace* space, size_t size);
+// Manages range mapped by the caller, pageMap needs 8 bytes per page of the range. Space with
+// both of them inside a file mapping at a fixed address stays valid when the file is mapped again
+void spaceInitAt(AddressSpace* space, void* base, size_t size, void* pageMap, bool fileBacked);
+// Initializes the lock again: process shared one for space in shared memory, or private one for
+// space found in a file mapping, where the lock may be left taken by a dead process
+void spaceInitLock(AddressSpace* space, bool processShared);
+// Same for other locks of the heap, process shared ones are robust: lockMutex takes over a lock
+// left by a dead process
+void spaceInitMutex(pthread_mutex_t* mutex, bool processShared);
+// Makes page aligned span readable and writable and marks its pages with the kind
+void* spaceCommit(AddressSpace* space, size_t size, SpanKind kind, bool populate);
+// Gives span memory back to the system and its range back to the space
+void spaceDecommit(AddressSpace* space, void* address, size_t size);
+// Grows span in place if the range right after it is not used
+bool spaceExtend(AddressSpace* space, void* address, size_t size, size_t newSize);
+// Gives pages of committed span back to the system, range stays accessible and reads zero pages
+void spaceDiscard(AddressSpace* space, void* address, size_t size);
+// Counts discarded pages as committed again when they are reused, false if it passes the limit
+// and checkLimit is set
+bool spaceReclaim(AddressSpace* space, size_t size, bool checkLimit);
+// Limit of committed bytes, 0 removes it
+void   spaceSetLimit(AddressSpace* space, size_t limit);
+size_t spaceCommitted(AddressSpace* space);
+// Start of the span the address belongs to, NULL if the address is not in a committed span
+void* spaceOwnerOf(AddressSpace* space, const void* address, SpanKind* kind);
+
+// Is this pointer ours: just a range compare
+static inline bool spaceContains(AddressSpace* space, const void* address)
+{
+    size_t top = atomic_load_explicit(&space->m_top, memory_order_acquire);
+    return (const unsigned char*)(address) >= space->m_base && (const unsigned char*)(address) < space->m_base + top;
+}
@@ -1,29 +1,96 @@
 #pragma once
 
+#include <address_space.h>
 #include <stdbool.h>
 #include <stddef.h>
 
+//-- Block sizes are multiples of 16, so low bits of the header are used for flags
+#define BT_FREE_BIT      ((size_t)1)
+#define BT_PREV_FREE_BIT ((size_t)2)
+#define BT_QUICK_BIT     ((size_t)4) /* used block parked in a quick list */
+#define BT_PURGED_BIT    ((size_t)8) /* free block with pages given back, cleared by any rewrite of the block */
+#define BT_FLAGS_MASK    ((size_t)15)
+
+//-- Footer exists only in free blocks (last word of the block), used blocks
+//-- carry only the header and previous block is found by BT_PREV_FREE_BIT
 typedef struct SBlockFooter
 {
-    int  m_blockSize;
-    bool m_isFree;
+    size_t m_blockSize;
 } BlockFooter;
 
+//-- Size of the whole block including header, with flags in low bits
 typedef struct SBlockHeader
 {
-    int  m_blockSize;
-    bool m_isFree;
+    size_t m_sizeAndFlags;
 } BlockHeader;
 
+//-- Free blocks are nodes of AVL tree ordered by (size, address), node lives in the payload
+typedef struct SFreeNode
+{
+    BlockHeader       m_header;
+    struct SFreeNode* m_left;
+    struct SFreeNode* m_right;
+    int               m_height;
+} FreeNode;
+
+//-- Recently freed blocks of one exact size, reused without splitting and coalescing
+#define BT_QUICK_LISTS       8
+#define BT_QUICK_LIST_LENGTH 8
+#define BT_QUICK_MAX_BLOCK   ((size_t)1 << 20)
+
+typedef struct SQuickList
+{
+    BlockHeader* m_head;
+    size_t       m_blockSize;
+    int          m_count;
+} QuickList;
+
 typedef struct SHeap
 {
-    void*        m_buffer;
-    BlockHeader* m_firstBlock;
-    BlockFooter* m_lastFooter;
-    size_t       m_bufferSize;
-    size_t       m_freeSpace;
+    void*         m_buffer;
+    BlockHeader*  m_firstBlock;
+    BlockHeader*  m_endMarker; /* zero sized used block closing the heap */
+    FreeNode*     m_freeTree;  /* best fit index of free blocks */
+    size_t        m_bufferSize;
+    size_t        m_freeSpace;   /* sum of sizes of all free blocks */
+    size_t        m_largestFree; /* size of the biggest free block */
+    size_t        m_blocksArea;  /* bytes between the first block and the end marker */
+    QuickList     m_quickLists[BT_QUICK_LISTS];
+    size_t        m_quickSpace;  /* sum of sizes of blocks in quick lists */
+    size_t        m_purgedSpace; /* bytes of free blocks given back by purge */
+    AddressSpace* m_space;       /* accounts purged pages, NULL to madvise them directly */
 } BTagsHeap;
 
+//-- Result of the walk over all blocks of the heap, sizes include tags
+typedef struct SBTagsStats
+{
+    size_t m_usedBlocks;
+    size_t m_usedBytes;
+    size_t m_freeBlocks;
+    size_t m_freeBytes;
+    size_t m_quickBlocks; /* used blocks parked in quick lists, not counted as used */
+    size_t m_quickBytes;
+    size_t m_largestFree;
+} BTagsStats;
+
 void  setupBTagsAllocator(void* buf, size_t size, BTagsHeap* heap);
 void* BTAlloc(size_t size, BTagsHeap* heap);
-void  BTFree(void* p, BTagsHeap* heap);
\ No newline at end of file
+void  BTFree(void* p, BTagsHeap* heap);
+// Takes block of exact size from quick lists, NULL if there is no such block
+void* BTAllocFromQuickList(size_t size, BTagsHeap* heap);
+// Coalesces all blocks parked in quick lists
+void BTFlushQuickLists(BTagsHeap* heap);
+// Size of the block (with tags) which keeps allocation of given size, 0 on overflow
+size_t BTBlockSizeFor(size_t size);
+// Buffer size needed to serve one allocation of given size
+size_t BTBufferSizeFor(size_t size);
+// Heap has no used blocks, blocks in quick lists are not counted as used
+bool BTIsEmpty(BTagsHeap* heap);
+// Buffer grew by growth bytes right after its end, new space is joined with the last free block
+void BTExtend(BTagsHeap* heap, size_t growth);
+// Walks all blocks of the heap
+void BTCollectStats(BTagsHeap* heap, BTagsStats* stats);
+// Purge discards pages through the space, and they count as committed again once the block is reused
+void BTUseAddressSpace(BTagsHeap* heap, AddressSpace* space);
+// Flushes quick lists and gives back whole pages inside free blocks, returns count of purged bytes
+size_t BTPurgeFreePages(BTagsHeap* heap);
@@ -0,0 +1,87 @@
+#pragma once
+
+//-- Internal state of the global heap, public API is in eh_malloc.h
+#include <address_space.h>
+#include <border_tags_allocator.h>
+#include <eh_malloc.h>
+#include <eh_malloc_inline.h>
+#include <eh_trace.h>
+#include <pthread.h>
+#include <slab_allocator.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define trace printf("File: %s --- Function: %s --- Line: %d\n", __FILE__, __FUNCTION__, __LINE__);
+
+//-- BT heaps are binned by floor(log2(largest free block))
+#define BT_HEAP_BINS 64
+//-- Empty BT heaps kept mapped for reuse instead of being given back on free
+#define BT_RETAINED_HEAPS 32
+//-- Maximum count of memory pressure callbacks
+#define EH_PRESSURE_CALLBACKS 8
+
+//-- What is done before failing allocation over the memory limit, in order
+typedef enum EPressureStage
+{
+    PS_Shrink,    /* give back empty slabs, empty BT heaps and free BT pages */
+    PS_Callbacks, /* call application callbacks */
+    PS_Count
+} PressureStage;
+
+typedef struct SBTagHeapsList
+{
+    BTagsHeap              m_heap;
+    struct SBTagHeapsList* m_next;
+    struct SBTagHeapsList* m_prev;
+    struct SBTagHeapsList* m_binNext;
+    struct SBTagHeapsList* m_binPrev;
+    int                    m_bin;
+    bool                   m_pinned;  /* reserved heap, never unmapped automatically */
+    unsigned               m_lastUse; /* BT epoch of the last alloc or free in the heap */
+} BTagHeapsList;
+
+typedef struct SGlobalHeap
+{
+    //-- All slabs and BT heaps live inside one reserved range
+    AddressSpace m_space;
+    //-- Small cache objects - till 64 bytes
+    Cache m_cacheSmall;
+    //-- Middle cache objects - from 64 till 512 bytes
+    Cache m_cacheMedium;
+    //-- Big objects - 4096 - from 512 to 4096
+    Cache m_cacheBig;
+    //-- Large objects - over 4096
+    BTagHeapsList* m_btHeaps;
+    int            m_btHeapsCount; /* new heaps grow geometrically with it */
+    //-- Heaps indexed by their largest free block, bit is set for non empty bin
+    BTagHeapsList* m_btBins[BT_HEAP_BINS];
+    uint64_t       m_btBinsMap;
+    //-- Heap which got the last block into its quick lists
+    BTagHeapsList* m_btRecentHeap;
+    //-- Retained heaps are out of the list and bins, linked by m_next, most recently retained first
+    BTagHeapsList* m_btRetained;
+    int            m_btRetainedCount;
+    size_t         m_btRetainedBytes;
+
+    //-- Background purge, BT epoch is ticked by the purge thread under m_btLock,
+    //-- the thread is started and stopped under m_mutex
+    unsigned       m_btEpoch;
+    atomic_bool    m_purgeRunning;
+    unsigned       m_purgeTickMs;
+    pthread_t      m_purgeThread;
+    pthread_cond_t m_purgeCond;
+
+    //-- Memory limit mirrors the limit of the address space, callbacks are under m_mutex
+    atomic_size_t    m_memoryLimit;
+    PressureCallback m_pressureCallbacks[EH_PRESSURE_CALLBACKS];
+    void*            m_pressureArgs[EH_PRESSURE_CALLBACKS];
+    int              m_pressureCallbacksCount;
+
+    //-- Flushes thread caches of exiting threads
+    pthread_key_t m_threadCacheKey;
+
+    pthread_once_t  m_initOnce;
+    pthread_mutex_t m_btLock; /* BT heaps, slab caches have their own sync */
+    pthread_mutex_t m_mutex;  /* purge thread and pressure callbacks, taken before m_btLock */
+} GlobalHeap;
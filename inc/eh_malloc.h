@@ -1,33 +1,125 @@
 #pragma once
 
-#include <border_tags_allocator.h>
-#include <pthread.h>
-#include <slab_allocator.h>
+//-- Public API, usable from C and C++
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
-#define trace printf("File: %s --- Function: %s --- Line: %d\n", __FILE__, __FUNCTION__, __LINE__);
+#ifdef __cplusplus
+extern "C" {
+#endif
 
-typedef struct SBTagHeapsList
-{
-    BTagsHeap              m_heap;
-    struct SBTagHeapsList* m_next;
-} BTagHeapsList;
+//-- Slab cache of the object cache API, its layout is internal
+typedef struct SCache Cache;
 
-typedef struct SGlobalHeap
-{
-    //-- Small cache objects - till 64 bytes
-    Cache m_cacheSmall;
-    //-- Middle cache objects - from 64 till 512 bytes
-    Cache m_cacheMedium;
-    //-- Big objects - 4096 - from 512 to 4096
-    Cache m_cacheBig;
-    //-- Large objects - over 4096
-    BTagHeapsList* m_btHeaps;
-
-    bool            m_onInit;
-    pthread_mutex_t m_mutex;
-} GlobalHeap;
+//-- Heap kept in a memory mapped file, see eh_persistent_open
+typedef struct SPersistentHeap PersistentHeap;
+
+//-- Block of a compact heap as offset from the heap start, 0 is no block
+typedef uint32_t CompactHandle;
+
+//-- Object cache callback, gets the object and the argument given to the cache
+typedef void (*CacheObjectCallback)(void* object, void* arg);
+
+//-- Called when allocation of `needed` bytes hits the memory limit, application drops its caches
+typedef void (*PressureCallback)(size_t needed, void* arg);
+
+//-- Flags of reserve API
+#define EH_RESERVE_POPULATE 1 /* prefault reserved memory */
 
 void* eh_malloc(size_t size);
 void  eh_free(void* address);
-void  dumpHeap();
\ No newline at end of file
+void  dumpHeap();
+// Writes JSON snapshot of the heap: slab occupancy histogram (10% buckets) of every cache, block
+// counts, largest free block and fragmentation (1 - largest free / free bytes) of every BT heap,
+// mapped and in use bytes. False if the file can't be written
+bool eh_dump_json(const char* path);
+// Free with the size given to eh_malloc, a size of another class than the block has is ignored
+void eh_free_sized(void* address, size_t size);
+
+//-- Every block of eh_malloc is aligned at least by this
+#define EH_MALLOC_ALIGNMENT 16
+
+// Block aligned by power of two alignment, has to be freed by eh_free_aligned with the same alignment
+void* eh_malloc_aligned(size_t size, size_t alignment);
+void  eh_free_aligned(void* address, size_t alignment);
+// Maps slabs for size class of objectSize ahead of time, they are kept mapped by shrink
+bool eh_reserve_slabs(size_t objectSize, size_t slabCount, int flags);
+// Maps BT heap able to keep `bytes` in one block, it's never unmapped automatically
+bool eh_reserve_large(size_t bytes, int flags);
+
+// Starts background thread giving back slabs and BT pages unused for about decayMs, while it
+// runs frees don't give memory back to the system themselves. False if it's already running
+bool eh_purge_start(unsigned decayMs);
+void eh_purge_stop();
+
+// Gives back all memory the heap can: empty slabs of every cache, empty BT heaps (the first one
+// too) and free pages inside used BT heaps. Free BT memory up to pad bytes is kept for reuse.
+// Reserved slabs and heaps stay, as do blocks in thread caches of other threads.
+// Returns count of released bytes
+size_t eh_trim(size_t pad);
+
+// Soft limit of mapped bytes of slabs and BT heaps, 0 removes it. Allocation over the limit
+// shrinks caches, then calls pressure callbacks and fails only if it's still over the limit
+void   eh_set_memory_limit(size_t bytes);
+size_t eh_mapped_bytes();
+bool   eh_add_pressure_callback(PressureCallback callback, void* arg);
+
+// Writes events traced by all threads into a text file, one "tid tsc event arg" per line.
+// False if the file can't be written or the library is built without tracing (make TRACE=1)
+bool eh_trace_dump(const char* path);
+
+// Object cache API: slab cache of objects of one size and alignment. Constructor runs for every
+// object when its slab is mapped, destructor when slab is given back, so objects returned by
+// eh_cache_alloc are constructed and must be freed back in constructed state.
+// Cache isn't shrunk automatically, call eh_cache_shrink to give empty slabs back
+Cache* eh_cache_create(size_t objectSize, size_t align, CacheObjectCallback ctor, CacheObjectCallback dtor,
+                       void* arg);
+void*  eh_cache_alloc(Cache* cache);
+void   eh_cache_free(Cache* cache, void* object);
+void   eh_cache_shrink(Cache* cache);
+// All objects have to be freed before, pointers to them become invalid
+void eh_cache_destroy(Cache* cache);
+
+// Persistent heap: slabs and BT heaps inside a file mapped at fixed page aligned base. New file is
+// created with given size, existing one is mapped with its own size and has to be opened at the
+// base it was created with. NULL if the range at base is taken or the file is not such heap.
+// Data reachable from the root pointer survives restart. File is consistent after
+// eh_persistent_sync or eh_persistent_close, a crash in the middle of allocation may break it
+PersistentHeap* eh_persistent_open(const char* path, void* base, size_t size);
+void*           eh_persistent_malloc(PersistentHeap* heap, size_t size);
+void            eh_persistent_free(PersistentHeap* heap, void* address);
+void            eh_persistent_set_root(PersistentHeap* heap, void* root);
+void*           eh_persistent_root(PersistentHeap* heap);
+bool            eh_persistent_sync(PersistentHeap* heap);
+// Syncs and unmaps the file, pointers into the heap become invalid
+void eh_persistent_close(PersistentHeap* heap);
+// Process shared heap in shared memory (memfd_create or shm_open descriptor). The first process
+// gives the size and formats empty memory, others map it with size 0. Every process has to map it
+// at the same base, then blocks are handed over between processes as plain pointers and may be
+// freed by any of them. The heap is used by eh_persistent_* functions, close unmaps it for caller.
+// Locks are robust: a process dying while it holds one doesn't hang the others, but the heap
+// may be left inconsistent if it died in the middle of an allocation or free
+PersistentHeap* eh_shared_open(int fd, void* base, size_t size);
+// Compact heap: slabs and BT heaps inside one private 4 GiB range, every block is addressed by
+// a 32 bit handle, so linked structures keep half size links. Handles are converted to pointers
+// and back by adding and subtracting the heap address. eh_persistent_malloc/free work on it too
+PersistentHeap* eh_compact_create();
+CompactHandle   eh_compact_malloc(PersistentHeap* heap, size_t size);
+void            eh_compact_free(PersistentHeap* heap, CompactHandle handle);
+// All handles and pointers into the heap become invalid
+void eh_compact_destroy(PersistentHeap* heap);
+
+static inline void* eh_compact_ptr(PersistentHeap* heap, CompactHandle handle)
+{
+    return handle != 0 ? (void*)((char*)(heap) + handle) : NULL;
+}
+
+static inline CompactHandle eh_compact_handle(PersistentHeap* heap, void* address)
+{
+    return address != NULL ? (CompactHandle)((char*)(address) - (char*)(heap)) : 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
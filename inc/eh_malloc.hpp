@@ -0,0 +1,215 @@
+#pragma once
+
+//-- C++ adapters: STL allocator and pmr memory resources on top of eh_malloc
+#include <eh_malloc.h>
+
+#include <cstddef>
+#include <memory_resource>
+#include <new>
+
+namespace eh
+{
+constexpr std::size_t mallocAlignment = EH_MALLOC_ALIGNMENT;
+
+//-- Stateless allocator for STL containers, size is passed to eh_free_sized on deallocation
+template <typename T>
+class allocator
+{
+    static_assert(alignof(T) <= mallocAlignment, "eh::allocator doesn't support over-aligned types");
+
+public:
+    using value_type = T;
+
+    allocator() noexcept = default;
+    template <typename U>
+    allocator(const allocator<U>&) noexcept
+    {
+    }
+
+    T* allocate(std::size_t count)
+    {
+        if (count > std::size_t(-1) / sizeof(T))
+        {
+            throw std::bad_array_new_length();
+        }
+        void* memory = eh_malloc(count != 0 ? count * sizeof(T) : 1);
+        if (memory == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(memory);
+    }
+
+    void deallocate(T* pointer, std::size_t count) noexcept
+    {
+        eh_free_sized(pointer, count != 0 ? count * sizeof(T) : 1);
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const allocator<T>&, const allocator<U>&) noexcept
+{
+    return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const allocator<T>&, const allocator<U>&) noexcept
+{
+    return false;
+}
+
+namespace pmr
+{
+//-- Memory resource calling eh_malloc, over-aligned blocks go to eh_malloc_aligned
+class malloc_resource final : public std::pmr::memory_resource
+{
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        void* memory = eh_malloc_aligned(bytes != 0 ? bytes : 1, alignment);
+        if (memory == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+        return memory;
+    }
+
+    void do_deallocate(void* pointer, std::size_t bytes, std::size_t alignment) override
+    {
+        if (alignment <= mallocAlignment)
+        {
+            eh_free_sized(pointer, bytes != 0 ? bytes : 1);
+            return;
+        }
+        eh_free_aligned(pointer, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        return dynamic_cast<const malloc_resource*>(&other) != nullptr;
+    }
+};
+
+inline malloc_resource* get_malloc_resource() noexcept
+{
+    static malloc_resource resource;
+    return &resource;
+}
+
+//-- Pool resource with one object cache per power of two size class up to a page, blocks are
+//-- freed straight to the cache of their class. Caches are lock free, so resource is thread safe.
+//-- Bigger or over-aligned blocks go to upstream, all pooled memory is released by release()
+class slab_pool_resource final : public std::pmr::memory_resource
+{
+public:
+    static constexpr std::size_t minClassSize = 16;
+    static constexpr std::size_t maxClassSize = 4096;
+    static constexpr std::size_t maxClassAlignment = 64;
+    static constexpr int         classesCount = 9; /* 16 ... 4096 */
+
+    explicit slab_pool_resource(std::pmr::memory_resource* upstream = get_malloc_resource())
+        : m_upstream(upstream)
+    {
+        createCaches();
+    }
+
+    slab_pool_resource(const slab_pool_resource&) = delete;
+    slab_pool_resource& operator=(const slab_pool_resource&) = delete;
+
+    ~slab_pool_resource() override
+    {
+        destroyCaches();
+    }
+
+    //-- All blocks of the pool become invalid
+    void release()
+    {
+        destroyCaches();
+        createCaches();
+    }
+
+    std::pmr::memory_resource* upstream_resource() const noexcept
+    {
+        return m_upstream;
+    }
+
+private:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        int index = classIndex(bytes, alignment);
+        if (index < 0)
+        {
+            return m_upstream->allocate(bytes, alignment);
+        }
+        void* memory = eh_cache_alloc(m_caches[index]);
+        if (memory == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+        return memory;
+    }
+
+    void do_deallocate(void* pointer, std::size_t bytes, std::size_t alignment) override
+    {
+        int index = classIndex(bytes, alignment);
+        if (index < 0)
+        {
+            m_upstream->deallocate(pointer, bytes, alignment);
+            return;
+        }
+        eh_cache_free(m_caches[index], pointer);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        return this == &other;
+    }
+
+    static std::size_t classSize(int index)
+    {
+        return minClassSize << index;
+    }
+
+    //-- -1 if block isn't served by caches
+    static int classIndex(std::size_t bytes, std::size_t alignment)
+    {
+        if (bytes > maxClassSize || alignment > maxClassAlignment)
+        {
+            return -1;
+        }
+        int index = 0;
+        while (classSize(index) < bytes || classSize(index) < alignment)
+        {
+            ++index;
+        }
+        return index;
+    }
+
+    void createCaches()
+    {
+        for (int i = 0; i < classesCount; ++i)
+        {
+            std::size_t size = classSize(i);
+            m_caches[i] = eh_cache_create(size, size < maxClassAlignment ? size : maxClassAlignment, nullptr,
+                                          nullptr, nullptr);
+            if (m_caches[i] == nullptr)
+            {
+                destroyCaches();
+                throw std::bad_alloc();
+            }
+        }
+    }
+
+    void destroyCaches() noexcept
+    {
+        for (Cache*& cache : m_caches)
+        {
+            eh_cache_destroy(cache);
+            cache = nullptr;
+        }
+    }
+
+    std::pmr::memory_resource* m_upstream;
+    Cache*                     m_caches[classesCount] = {};
+};
+} // namespace pmr
+} // namespace eh
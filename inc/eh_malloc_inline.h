@@ -0,0 +1,80 @@
+#pragma once
+
+//-- Optional inline fast path: for sizes known at compile time size class is selected by the
+//-- compiler and the block is taken from the free list of the calling thread, the library is
+//-- called only when the list is empty (or full on free). Other sizes go to eh_malloc/eh_free_sized
+#include <eh_malloc.h>
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//-- Object sizes of slab caches of the heap, classes of the thread cache are the same
+#define EH_SMALL_SLAB_SIZE  64
+#define EH_MEDIUM_SLAB_SIZE 512
+#define EH_BIG_SLAB_SIZE    4096
+
+#define EH_THREAD_CACHE_CLASSES 3
+#define EH_THREAD_CACHE_LENGTH  16
+#define EH_INLINE_MAX_SIZE      EH_BIG_SLAB_SIZE
+
+typedef struct SThreadCache
+{
+    void* m_heads[EH_THREAD_CACHE_CLASSES]; /* blocks are linked through their first word */
+    int   m_counts[EH_THREAD_CACHE_CLASSES];
+    bool  m_registered; /* lists are flushed back to caches on thread exit */
+    bool  m_exited;     /* exit flush is done, later frees of the thread bypass the lists */
+} ThreadCache;
+
+extern __thread ThreadCache eh_thread_cache;
+
+// Fills the list of the class and returns one block, NULL if allocation fails
+void* eh_thread_cache_refill(int sizeClass);
+// Gives blocks of calling thread lists back to their caches
+void eh_thread_cache_flush();
+
+static inline int eh_size_class(size_t size)
+{
+    return size <= EH_SMALL_SLAB_SIZE ? 0 : (size <= EH_MEDIUM_SLAB_SIZE ? 1 : 2);
+}
+
+static inline void* eh_malloc_inline(size_t size)
+{
+    if (__builtin_constant_p(size) && size != 0 && size <= EH_INLINE_MAX_SIZE)
+    {
+        int   sizeClass = eh_size_class(size);
+        void* block = eh_thread_cache.m_heads[sizeClass];
+        if (__builtin_expect(block != NULL, 1))
+        {
+            eh_thread_cache.m_heads[sizeClass] = *(void**)(block);
+            --eh_thread_cache.m_counts[sizeClass];
+            return block;
+        }
+        return eh_thread_cache_refill(sizeClass);
+    }
+    return eh_malloc(size);
+}
+
+// Size has to be the one given on allocation
+static inline void eh_free_inline(void* address, size_t size)
+{
+    if (__builtin_constant_p(size) && size != 0 && size <= EH_INLINE_MAX_SIZE && address != NULL)
+    {
+        int sizeClass = eh_size_class(size);
+        if (__builtin_expect(eh_thread_cache.m_registered, 1) &&
+            eh_thread_cache.m_counts[sizeClass] < EH_THREAD_CACHE_LENGTH)
+        {
+            *(void**)(address) = eh_thread_cache.m_heads[sizeClass];
+            eh_thread_cache.m_heads[sizeClass] = address;
+            ++eh_thread_cache.m_counts[sizeClass];
+            return;
+        }
+    }
+    eh_free_sized(address, size);
+}
+
+#ifdef __cplusplus
+}
+#endif
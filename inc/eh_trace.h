@@ -0,0 +1,76 @@
+#pragma once
+
+//-- Event tracing, compiled in with -DEH_TRACE (make TRACE=1). Every thread writes its events
+//-- into its own ring without locks, eh_trace_dump writes rings of all threads into a file.
+//-- Without EH_TRACE macros expand to nothing and locks are taken directly
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+//-- Events kept by one thread, older ones are overwritten
+#define EH_TRACE_EVENTS 4096
+
+typedef enum ETraceEventType
+{
+    TE_LockWait,    /* contended lock, arg is cycles waited */
+    TE_SlabCreate,  /* arg is slab size */
+    TE_SlabRelease, /* slab body given back by shrink, arg is released bytes */
+    TE_SlabDestroy, /* arg is slab size */
+    TE_HeapMap,     /* BT heap mapped, arg is mapping size */
+    TE_HeapUnmap,   /* BT heap unmapped, arg is mapping size */
+    TE_Coalesce,    /* freed BT block joined with neighbours, arg is size of joined block */
+    TE_HeapExtend,  /* BT heap grown in place, arg is growth */
+    TE_Count
+} TraceEventType;
+
+//-- Robust mutex of a process shared heap is taken over when its owner died holding it, the
+//-- structure it guards is used as the dead process left it
+static inline void lockMutex(pthread_mutex_t* mutex)
+{
+    if (pthread_mutex_lock(mutex) == EOWNERDEAD)
+    {
+        pthread_mutex_consistent(mutex);
+    }
+}
+
+static inline bool tryLockMutex(pthread_mutex_t* mutex)
+{
+    int result = pthread_mutex_trylock(mutex);
+    if (result == EOWNERDEAD)
+    {
+        pthread_mutex_consistent(mutex);
+    }
+    return result == 0 || result == EOWNERDEAD;
+}
+
+#ifdef EH_TRACE
+
+#include <x86intrin.h>
+
+void traceEvent(TraceEventType type, uint64_t arg);
+
+#define TRACE_EVENT(type, arg) traceEvent((type), (uint64_t)(arg))
+
+//-- Waiting is recorded only when the lock is taken by someone else
+static inline void traceLock(pthread_mutex_t* mutex)
+{
+    if (tryLockMutex(mutex))
+    {
+        return;
+    }
+    uint64_t start = __rdtsc();
+    lockMutex(mutex);
+    traceEvent(TE_LockWait, __rdtsc() - start);
+}
+
+#else
+
+#define TRACE_EVENT(type, arg) ((void)0)
+
+static inline void traceLock(pthread_mutex_t* mutex)
+{
+    lockMutex(mutex);
+}
+
+#endif
@@ -0,0 +1,43 @@
+#pragma once
+
+//-- Heap kept in a file or shared memory mapped at a fixed address. File layout:
+//--   page aligned PersistentHeap | page map of the space | range of the space (slabs and BT heaps)
+//-- Every pointer inside the file is absolute, so the file is valid only at the address it was
+//-- created for. Layout is checked on open by magic, version and size of PersistentHeap.
+//-- Heap in shared memory is mapped at the same base by every process, so the same pointers are
+//-- valid in all of them, and its locks are process shared
+#include <address_space.h>
+#include <border_tags_allocator.h>
+#include <eh_malloc.h>
+#include <pthread.h>
+#include <slab_allocator.h>
+#include <stdint.h>
+
+#define PH_MAGIC   0x504548414c4c4f43ULL
+#define PH_VERSION 3
+//-- Slab caches of 8 to 64, 512 and 4096 bytes objects, bigger blocks go to BT heaps. Small classes
+//-- keep nodes of compact heaps linked by 32 bit handles at their own size
+#define PH_CACHES 6
+
+//-- BT heap span: this node and the buffer of the allocator right after it
+typedef struct SPersistentBTHeap
+{
+    BTagsHeap                 m_heap;
+    struct SPersistentBTHeap* m_next;
+    size_t                    m_mappingSize;
+} PersistentBTHeap;
+
+typedef struct SPersistentHeap
+{
+    uint64_t          m_magic; /* written last on format, file without it is not a heap */
+    uint32_t          m_version;
+    uint32_t          m_layoutSize; /* sizeof(PersistentHeap) */
+    void*             m_base;       /* address the file has to be mapped at */
+    size_t            m_size;       /* file size */
+    void*             m_root;
+    AddressSpace      m_space;
+    Cache             m_caches[PH_CACHES];
+    PersistentBTHeap* m_btHeaps;
+    pthread_mutex_t   m_lock; /* BT heaps, slab caches are lock free */
+    bool              m_processShared;
+} PersistentHeap;
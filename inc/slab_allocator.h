@@ -1,8 +1,14 @@
 #pragma once
 
+#include <address_space.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
+//-- SS_Free: slab is closed (no slot can be claimed) and sits in free slabs stack,
+//-- SS_PartlyFull: slab is in partly full stack, SS_Full: slab was full when taken off the stack
 typedef enum ESlabState
 {
     SS_Free,
@@ -10,36 +16,121 @@ typedef enum ESlabState
     SS_Full
 } SlabState;
 
+typedef enum ESlabLayout
+{
+    SL_Inline, /* header followed by objects, only free blocks count is tracked */
+    SL_Bitmap  /* header with occupancy bitmap, objects start at an aligned offset */
+} SlabLayout;
+
+//-- Object cache callback, gets the object and the argument given to the cache
+typedef void (*CacheObjectCallback)(void* object, void* arg);
+
+//-- Slab orders a cache grows through: from the order fitting minimal object count up to
+//-- 2 MiB slabs (huge page size)
+#define SLAB_GEOMETRIES 10
+
+//-- Size and layout of slabs of one order, every slab keeps index of its geometry
+typedef struct SSlabGeometry
+{
+    int    m_slabOrder;    /* slab size is 2^order * 4096 */
+    int    m_slabSize;
+    size_t m_slabObjects;  /* count of objects in one slab */
+    size_t m_objectOffset; /* offset of the first object from slab start */
+    size_t m_bitmapWords;  /* SL_Bitmap: count of 64 bit words in m_freeMap */
+} SlabGeometry;
+
 typedef struct SCSlabData
 {
-    struct SCSlabData* m_next;
-    struct SCSlabData* m_prev;
-    SlabState          m_state;
-    int                m_freeBlocksCount;
+    _Atomic(struct SCSlabData*) m_next;    /* link in free or partly full stack */
+    struct SCSlabData*          m_allNext; /* link in the list of all slabs of the cache */
+    struct SCache*              m_cache;
+    _Atomic(SlabState)          m_state;
+    atomic_int                  m_freeBlocksCount; /* slot is claimed by decrement of the counter */
+    atomic_bool                 m_listed;          /* slab is in partly full stack */
+    atomic_uint                 m_emptyEpoch;      /* cache epoch when slab got empty last time */
+    bool                        m_bodyReleased;    /* pages after the header were given back */
+    bool                        m_constructed;     /* constructor was called for every object */
+    int                         m_geometry;        /* index in m_geometries of the cache */
+    atomic_uint                 m_freeHint;        /* SL_Bitmap: search for a free bit starts at this word */
+    _Atomic(uint64_t)           m_freeMap[];       /* SL_Bitmap only: bit set means slot is free */
 } CSlabData;
 
-// Contains all data about current cache
+// Contains all data about current cache.
+// cacheAlloc and cacheFree are lock free: slabs stacks are tagged pointers (tag in bits 48-63)
+// changed by CAS and slots are claimed with atomics. Slab headers stay mapped while cache lives,
+// so thread holding a stale slab pointer can always read it, only pages after the header are
+// given back to the system. Slab creation, shrink and reserve take m_lock.
 typedef struct SCache
 {
-    CSlabData* m_freeSlabs;
-    CSlabData* m_fullSlabs;
-    CSlabData* m_partlyFullSlabs;
-
-    size_t m_objectSize;  /* allocating object size */
-    size_t m_slabObjects; /* count of objects in one SLAB */
-    int    m_slabOrder;   /* slab order size (i.e. (2^order * 4096)) SLAB */
-    int    m_slabSize;    /* slab size after applying the formula above */
+    _Atomic(uint64_t)   m_freeSlabs;       /* closed slabs, ready to be opened */
+    _Atomic(uint64_t)   m_partlyFullSlabs; /* open slabs, may be full until somebody pops them */
+    _Atomic(CSlabData*) m_allSlabs;        /* grows under m_lock, released only by cacheRelease */
+    atomic_size_t       m_emptySlabs;      /* open slabs without allocated objects */
+    pthread_mutex_t     m_lock;
+
+    size_t        m_objectSize;    /* allocating object size */
+    SlabLayout    m_layout;        /* where slab metadata lives */
+    size_t        m_objectAlign;   /* SL_Bitmap: alignment of every object in slab */
+    atomic_size_t m_slabsCount;    /* count of slabs with committed pages */
+    size_t        m_reservedSlabs; /* slabs kept committed by shrink */
+    AddressSpace* m_space;         /* where slabs are committed, NULL to mmap them */
+    atomic_bool   m_autoShrink;    /* free shrinks the cache when it has more than one empty slab */
+    atomic_uint   m_epoch;         /* ticked by cachePurge */
+
+    //-- Adaptive slab size: new slabs use the current geometry. It goes one order up after
+    //-- a streak of slab creations with nothing given back, and one order down when shrink
+    //-- gives slab bodies back. Changed under m_lock, slabs of all sizes live together
+    SlabGeometry m_geometries[SLAB_GEOMETRIES];
+    int          m_geometriesCount;
+    int          m_currentGeometry;
+    int          m_growthStreak; /* slabs created since the last release of slab bodies */
+
+    //-- Object cache: objects are constructed when slab is opened first time and destructed
+    //-- only when slab pages are given back, so cached objects stay constructed
+    CacheObjectCallback m_ctor;
+    CacheObjectCallback m_dtor;
+    void*               m_callbackArg;
 } Cache;
 
 // Set up cache for forward usages
 void cacheSetup(Cache* cache, size_t object_size);
+// Set up cache with explicit slab layout
+void cacheSetupWithLayout(Cache* cache, size_t object_size, SlabLayout layout);
+// Set up SL_Bitmap cache of objects aligned by align (power of two up to page size) with optional
+// constructor and destructor, false if such objects can't be placed in slab
+bool cacheSetupObjects(Cache* cache, size_t objectSize, size_t align, CacheObjectCallback ctor,
+                       CacheObjectCallback dtor, void* arg);
+// Commit slabs inside the address space instead of mapping them one by one
+void cacheUseAddressSpace(Cache* cache, AddressSpace* space);
+// Initializes the lock again: process shared one for cache in shared memory, or private one for
+// cache found in a file mapping, where the lock may be left taken by a dead process
+void cacheInitLock(Cache* cache, bool processShared);
 // Allocates memory (return >= object_size) from cache
 void* cacheAlloc(Cache* cache);
-// Function returns all free slabs to system
+// Function returns all free slabs to system, reserved slabs stay
 void cacheShrink(Cache* cache);
-// Return all memory from cache to system
+// Ticks cache epoch and returns to system slabs which are empty for at least age ticks
+void cachePurge(Cache* cache, unsigned age);
+// Maps free slabs ahead of time (prefaulted if populate is set), they are never shrunk
+bool cacheReserve(Cache* cache, size_t slabCount, bool populate);
+// Return all memory from cache to system, cache must not be used concurrently,
+// destructor is called for every object of constructed slabs
 void cacheRelease(Cache* cache);
-// Returns memory back in cache
+// Returns memory back in cache, double and misaligned frees are ignored for SL_Bitmap
 void cacheFree(Cache* cache, void* ptr);
+// Same as cacheFree for callers which already found the slab of the pointer
+void cacheFreeToSlab(Cache* cache, CSlabData* slab, void* ptr);
 // Check if a pointer in the cache
-bool hasAddressInCache(void* address, Cache* cache);
\ No newline at end of file
+bool hasAddressInCache(void* address, Cache* cache);
+// SL_Bitmap: check that pointer is a start of currently allocated object
+bool cacheIsObjectAllocated(Cache* cache, void* ptr);
+// Count of allocated objects in all slabs of the cache
+size_t cacheObjectsInUse(Cache* cache);
+// Count of allocated objects in the slab, 0 for closed slab
+size_t slabObjectsInUse(Cache* cache, CSlabData* slab);
+// Count of slots which can be claimed in the slab
+int slabFreeBlocks(CSlabData* slab);
+// Size and layout of the slab
+const SlabGeometry* slabGeometry(Cache* cache, CSlabData* slab);
+// Geometry of slabs created now
+const SlabGeometry* cacheCurrentGeometry(Cache* cache);
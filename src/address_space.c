@@ -0,0 +1,350 @@
+#include <address_space.h>
+#include <eh_trace.h>
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#undef _GNU_SOURCE
+
+typedef unsigned char byte;
+
+const size_t spacePageSize = 4096;
+const size_t minSpaceSize = (size_t)1 << 30;
+
+static void markPages(AddressSpace* space, size_t offset, size_t size, size_t ownerOffset, SpanKind kind)
+{
+    uint64_t entry = kind == SK_None ? 0 : ((ownerOffset / spacePageSize + 1) << 2) | kind;
+    for (size_t page = offset / spacePageSize; page < (offset + size) / spacePageSize; ++page)
+    {
+        atomic_store_explicit(&space->m_pageMap[page], entry, memory_order_release);
+    }
+}
+
+static void populatePages(void* address, size_t size)
+{
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(address, size, MADV_POPULATE_WRITE) == 0)
+    {
+        return;
+    }
+#endif
+    //-- Fresh pages are zero, so writing zero to each of them just faults them in
+    for (size_t shift = 0; shift < size; shift += spacePageSize)
+    {
+        ((volatile byte*)(address))[shift] = 0;
+    }
+}
+
+//-- Free extents operations
+static void removeExtent(AddressSpace* space, int index)
+{
+    for (int i = index; i + 1 < space->m_freeExtentsCount; ++i)
+    {
+        space->m_freeExtents[i] = space->m_freeExtents[i + 1];
+    }
+    --space->m_freeExtentsCount;
+}
+
+//-- Takes first extent which fits, returns offset or m_size if there is no such extent
+static size_t takeFromExtents(AddressSpace* space, size_t size)
+{
+    for (int i = 0; i < space->m_freeExtentsCount; ++i)
+    {
+        SpanExtent* extent = &space->m_freeExtents[i];
+        if (extent->m_size >= size)
+        {
+            size_t offset = extent->m_offset;
+            extent->m_offset += size;
+            extent->m_size -= size;
+            if (extent->m_size == 0)
+            {
+                removeExtent(space, i);
+            }
+            return offset;
+        }
+    }
+    return space->m_size;
+}
+
+//-- Returns range to the space joining it with neighbours, range touching the top lowers the top
+static void putToExtents(AddressSpace* space, size_t offset, size_t size)
+{
+    int index = 0;
+    while (index < space->m_freeExtentsCount && space->m_freeExtents[index].m_offset < offset)
+    {
+        ++index;
+    }
+    if (index > 0)
+    {
+        SpanExtent* prev = &space->m_freeExtents[index - 1];
+        if (prev->m_offset + prev->m_size == offset)
+        {
+            offset = prev->m_offset;
+            size += prev->m_size;
+            removeExtent(space, --index);
+        }
+    }
+    if (index < space->m_freeExtentsCount && offset + size == space->m_freeExtents[index].m_offset)
+    {
+        size += space->m_freeExtents[index].m_size;
+        removeExtent(space, index);
+    }
+    if (offset + size == space->m_top)
+    {
+        space->m_top = offset;
+        return;
+    }
+    if (space->m_freeExtentsCount == AS_MAX_FREE_EXTENTS)
+    {
+        return;
+    }
+    for (int i = space->m_freeExtentsCount; i > index; --i)
+    {
+        space->m_freeExtents[i] = space->m_freeExtents[i - 1];
+    }
+    space->m_freeExtents[index].m_offset = offset;
+    space->m_freeExtents[index].m_size = size;
+    ++space->m_freeExtentsCount;
+}
+
+//-- Pages of file mapping are removed from the file, DONTNEED would only drop them from memory
+static void releasePages(AddressSpace* space, void* address, size_t size)
+{
+    madvise(address, size, space->m_fileBacked ? MADV_REMOVE : MADV_DONTNEED);
+}
+
+//-- Address space API
+static void resetSpace(AddressSpace* space)
+{
+    space->m_base = NULL;
+    space->m_size = 0;
+    space->m_top = 0;
+    space->m_committed = 0;
+    space->m_limit = 0;
+    space->m_freeExtentsCount = 0;
+    space->m_fileBacked = false;
+    pthread_mutex_init(&space->m_lock, NULL);
+}
+
+bool spaceInit(AddressSpace* space, size_t size)
+{
+    resetSpace(space);
+
+    for (; size >= minSpaceSize; size /= 2)
+    {
+        void* base = mmap(NULL, size, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+        if (base == MAP_FAILED)
+        {
+            continue;
+        }
+        size_t mapSize = size / spacePageSize * sizeof(uint64_t);
+        void*  pageMap = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE,
+                              -1, 0);
+        if (pageMap == MAP_FAILED)
+        {
+            munmap(base, size);
+            continue;
+        }
+        space->m_base = (byte*)(base);
+        space->m_size = size;
+        space->m_pageMap = (_Atomic(uint64_t)*)(pageMap);
+        return true;
+    }
+    return false;
+}
+
+void spaceInitAt(AddressSpace* space, void* base, size_t size, void* pageMap, bool fileBacked)
+{
+    resetSpace(space);
+    space->m_base = (byte*)(base);
+    space->m_size = size / spacePageSize * spacePageSize;
+    space->m_pageMap = (_Atomic(uint64_t)*)(pageMap);
+    space->m_fileBacked = fileBacked;
+}
+
+void spaceInitLock(AddressSpace* space, bool processShared)
+{
+    spaceInitMutex(&space->m_lock, processShared);
+}
+
+void spaceInitMutex(pthread_mutex_t* mutex, bool processShared)
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, processShared ? PTHREAD_PROCESS_SHARED : PTHREAD_PROCESS_PRIVATE);
+    if (processShared)
+    {
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    }
+    pthread_mutex_init(mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+static bool fitsLimit(AddressSpace* space, size_t size)
+{
+    return space->m_limit == 0 || (space->m_committed <= space->m_limit && size <= space->m_limit - space->m_committed);
+}
+
+static void* commitLocked(AddressSpace* space, size_t size, SpanKind kind, bool populate)
+{
+    if (!fitsLimit(space, size))
+    {
+        return NULL;
+    }
+    size_t offset = takeFromExtents(space, size);
+    if (offset == space->m_size)
+    {
+        if (size > space->m_size - space->m_top)
+        {
+            return NULL;
+        }
+        offset = space->m_top;
+        space->m_top += size;
+    }
+
+    byte* address = space->m_base + offset;
+    if (mprotect(address, size, PROT_READ | PROT_WRITE) != 0)
+    {
+        putToExtents(space, offset, size);
+        return NULL;
+    }
+    if (populate)
+    {
+        populatePages(address, size);
+    }
+    markPages(space, offset, size, offset, kind);
+    space->m_committed += size;
+    return address;
+}
+
+void* spaceCommit(AddressSpace* space, size_t size, SpanKind kind, bool populate)
+{
+    if (space->m_base == NULL || size == 0 || size % spacePageSize != 0)
+    {
+        return NULL;
+    }
+    lockMutex(&space->m_lock);
+    void* address = commitLocked(space, size, kind, populate);
+    pthread_mutex_unlock(&space->m_lock);
+    return address;
+}
+
+void spaceDecommit(AddressSpace* space, void* address, size_t size)
+{
+    size_t offset = (byte*)(address) - space->m_base;
+    lockMutex(&space->m_lock);
+    releasePages(space, address, size);
+    //-- Protection is per process, span of shared mapping may be committed again by another one
+    if (!space->m_fileBacked)
+    {
+        mprotect(address, size, PROT_NONE);
+    }
+    markPages(space, offset, size, 0, SK_None);
+    space->m_committed -= size;
+    putToExtents(space, offset, size);
+    pthread_mutex_unlock(&space->m_lock);
+}
+
+static bool extendLocked(AddressSpace* space, size_t offset, size_t size, size_t growth)
+{
+    size_t end = offset + size;
+    if (!fitsLimit(space, growth))
+    {
+        return false;
+    }
+
+    if (end == space->m_top && growth <= space->m_size - space->m_top)
+    {
+        space->m_top += growth;
+    }
+    else
+    {
+        int index = 0;
+        while (index < space->m_freeExtentsCount && space->m_freeExtents[index].m_offset != end)
+        {
+            ++index;
+        }
+        if (index == space->m_freeExtentsCount || space->m_freeExtents[index].m_size < growth)
+        {
+            return false;
+        }
+        space->m_freeExtents[index].m_offset += growth;
+        space->m_freeExtents[index].m_size -= growth;
+        if (space->m_freeExtents[index].m_size == 0)
+        {
+            removeExtent(space, index);
+        }
+    }
+
+    if (mprotect(space->m_base + end, growth, PROT_READ | PROT_WRITE) != 0)
+    {
+        putToExtents(space, end, growth);
+        return false;
+    }
+    markPages(space, end, growth, offset, (SpanKind)(space->m_pageMap[offset / spacePageSize] & 3));
+    space->m_committed += growth;
+    return true;
+}
+
+bool spaceExtend(AddressSpace* space, void* address, size_t size, size_t newSize)
+{
+    size_t growth = newSize - size;
+    if (newSize <= size || growth % spacePageSize != 0)
+    {
+        return false;
+    }
+    lockMutex(&space->m_lock);
+    bool result = extendLocked(space, (byte*)(address) - space->m_base, size, growth);
+    pthread_mutex_unlock(&space->m_lock);
+    return result;
+}
+
+void spaceDiscard(AddressSpace* space, void* address, size_t size)
+{
+    releasePages(space, address, size);
+    lockMutex(&space->m_lock);
+    space->m_committed -= size;
+    pthread_mutex_unlock(&space->m_lock);
+}
+
+bool spaceReclaim(AddressSpace* space, size_t size, bool checkLimit)
+{
+    lockMutex(&space->m_lock);
+    bool result = !checkLimit || fitsLimit(space, size);
+    if (result)
+    {
+        space->m_committed += size;
+    }
+    pthread_mutex_unlock(&space->m_lock);
+    return result;
+}
+
+void spaceSetLimit(AddressSpace* space, size_t limit)
+{
+    lockMutex(&space->m_lock);
+    space->m_limit = limit;
+    pthread_mutex_unlock(&space->m_lock);
+}
+
+size_t spaceCommitted(AddressSpace* space)
+{
+    lockMutex(&space->m_lock);
+    size_t committed = space->m_committed;
+    pthread_mutex_unlock(&space->m_lock);
+    return committed;
+}
+
+void* spaceOwnerOf(AddressSpace* space, const void* address, SpanKind* kind)
+{
+    if (!spaceContains(space, address))
+    {
+        *kind = SK_None;
+        return NULL;
+    }
+    uint64_t entry = atomic_load_explicit(&space->m_pageMap[((const byte*)(address) - space->m_base) / spacePageSize],
+                                          memory_order_acquire);
+    *kind = (SpanKind)(entry & 3);
+    if (entry == 0)
+    {
+        return NULL;
+    }
+    return space->m_base + ((entry >> 2) - 1) * spacePageSize;
+}
@@ -1,68 +1,305 @@
 #include <border_tags_allocator.h>
+#include <eh_trace.h>
 #include <stdint.h>
+#include <sys/mman.h>
 
 typedef unsigned char byte;
 
-const size_t headerFooterSize = sizeof(BlockFooter) + sizeof(BlockHeader);
 const size_t headerSize = sizeof(BlockHeader);
 const size_t footerSize = sizeof(BlockFooter);
-const int    minBlockSize = sizeof(char) + headerFooterSize;
+const size_t blockAlignment = 16;
+const size_t purgePageSize = 4096;
+//-- Free block has to keep tree node and footer
+const size_t minBlockSize = (sizeof(FreeNode) + sizeof(BlockFooter) + 15) & ~(size_t)15;
 
-int64_t getAvailableSpaceWithoutMarkers(size_t size)
+static inline size_t alignUpBT(size_t value)
 {
-    return size - headerFooterSize;
+    return (value + blockAlignment - 1) & ~(blockAlignment - 1);
 }
 
-void initHeap(void* buf, size_t size, BTagsHeap* heap)
+static inline size_t blockSize(BlockHeader* header)
 {
-    heap->m_buffer = buf;
-    heap->m_bufferSize = size;
-    heap->m_freeSpace = getAvailableSpaceWithoutMarkers(size);
+    return header->m_sizeAndFlags & ~BT_FLAGS_MASK;
+}
+
+static inline bool isFree(BlockHeader* header)
+{
+    return header->m_sizeAndFlags & BT_FREE_BIT;
+}
+
+static inline bool isPrevFree(BlockHeader* header)
+{
+    return header->m_sizeAndFlags & BT_PREV_FREE_BIT;
+}
+
+static inline void setPrevFree(BlockHeader* header, bool prevFree)
+{
+    header->m_sizeAndFlags = prevFree ? header->m_sizeAndFlags | BT_PREV_FREE_BIT
+                                      : header->m_sizeAndFlags & ~BT_PREV_FREE_BIT;
+}
+
+static inline BlockFooter* getFooter(BlockHeader* header)
+{
+    return (BlockFooter*)((byte*)(header) + blockSize(header) - footerSize);
+}
 
-    // initialize first header and footer which we will use to cut blocks from
-    // here header goes
-    heap->m_firstBlock = (BlockHeader*)heap->m_buffer;
-    heap->m_firstBlock->m_blockSize = heap->m_freeSpace;
-    heap->m_firstBlock->m_isFree = true;
+static inline BlockHeader* getNextBlock(BlockHeader* header)
+{
+    return (BlockHeader*)((byte*)(header) + blockSize(header));
+}
 
-    // here goes footer
-    heap->m_lastFooter = (BlockFooter*)((byte*)(heap->m_buffer) + (size - sizeof(BlockFooter)));
-    heap->m_lastFooter->m_blockSize = heap->m_freeSpace;
-    heap->m_lastFooter->m_isFree = true;
+//-- Valid only when previous block is free, so it has a footer
+static inline BlockHeader* getPrevBlock(BlockHeader* header)
+{
+    BlockFooter* prevFooter = (BlockFooter*)((byte*)(header) - footerSize);
+    return (BlockHeader*)((byte*)(header) - prevFooter->m_blockSize);
 }
 
-void* blockHeaderShift(void* start)
+static inline void* payloadOf(BlockHeader* header)
 {
-    return (byte*)(start) + sizeof(BlockHeader);
+    return (byte*)(header) + headerSize;
 }
 
-void* blockFooterShift(void* start)
+//-- Marks block as free with given size and writes its footer, flag of the previous block is kept
+static void markFree(BlockHeader* header, size_t size)
 {
-    return (byte*)(start) + sizeof(BlockFooter);
+    header->m_sizeAndFlags = size | BT_FREE_BIT | (header->m_sizeAndFlags & BT_PREV_FREE_BIT);
+    getFooter(header)->m_blockSize = size;
+    setPrevFree(getNextBlock(header), true);
 }
 
-size_t transformToSizeWithTags(size_t size)
+//-- Size ordered tree of free blocks, ties are broken by address
+static inline bool nodeLess(FreeNode* left, FreeNode* right)
 {
-    return size + sizeof(BlockFooter) + sizeof(BlockHeader);
+    size_t leftSize = blockSize(&left->m_header);
+    size_t rightSize = blockSize(&right->m_header);
+    return leftSize < rightSize || (leftSize == rightSize && left < right);
 }
 
-BlockHeader* getHeader(BlockFooter* footer)
+static inline int nodeHeight(FreeNode* node)
 {
-    return (BlockHeader*)((byte*)(footer) - (footer->m_blockSize + headerSize));
+    return node != NULL ? node->m_height : 0;
 }
 
-BlockFooter* getFooter(BlockHeader* header)
+static inline void updateHeight(FreeNode* node)
 {
-    return (BlockFooter*)((byte*)(header) + (header->m_blockSize + headerSize));
+    int left = nodeHeight(node->m_left);
+    int right = nodeHeight(node->m_right);
+    node->m_height = (left > right ? left : right) + 1;
 }
 
-BlockHeader* getNextBlock(BlockHeader* header, BTagsHeap* heap)
+static FreeNode* rotateRight(FreeNode* node)
 {
-    if (getFooter(header) == heap->m_lastFooter)
+    FreeNode* left = node->m_left;
+    node->m_left = left->m_right;
+    left->m_right = node;
+    updateHeight(node);
+    updateHeight(left);
+    return left;
+}
+
+static FreeNode* rotateLeft(FreeNode* node)
+{
+    FreeNode* right = node->m_right;
+    node->m_right = right->m_left;
+    right->m_left = node;
+    updateHeight(node);
+    updateHeight(right);
+    return right;
+}
+
+static FreeNode* rebalance(FreeNode* node)
+{
+    updateHeight(node);
+    int balance = nodeHeight(node->m_left) - nodeHeight(node->m_right);
+    if (balance > 1)
+    {
+        if (nodeHeight(node->m_left->m_left) < nodeHeight(node->m_left->m_right))
+        {
+            node->m_left = rotateLeft(node->m_left);
+        }
+        return rotateRight(node);
+    }
+    if (balance < -1)
+    {
+        if (nodeHeight(node->m_right->m_right) < nodeHeight(node->m_right->m_left))
+        {
+            node->m_right = rotateRight(node->m_right);
+        }
+        return rotateLeft(node);
+    }
+    return node;
+}
+
+static FreeNode* insertNode(FreeNode* root, FreeNode* node)
+{
+    if (root == NULL)
+    {
+        node->m_left = NULL;
+        node->m_right = NULL;
+        node->m_height = 1;
+        return node;
+    }
+    if (nodeLess(node, root))
+    {
+        root->m_left = insertNode(root->m_left, node);
+    }
+    else
+    {
+        root->m_right = insertNode(root->m_right, node);
+    }
+    return rebalance(root);
+}
+
+static FreeNode* detachMinNode(FreeNode* root, FreeNode** minNode)
+{
+    if (root->m_left == NULL)
+    {
+        *minNode = root;
+        return root->m_right;
+    }
+    root->m_left = detachMinNode(root->m_left, minNode);
+    return rebalance(root);
+}
+
+static FreeNode* removeNode(FreeNode* root, FreeNode* node)
+{
+    if (root == NULL)
     {
         return NULL;
     }
-    return (BlockHeader*)((byte*)(getFooter(header)) + footerSize);
+    if (root == node)
+    {
+        if (root->m_left == NULL)
+        {
+            return root->m_right;
+        }
+        if (root->m_right == NULL)
+        {
+            return root->m_left;
+        }
+        FreeNode* successor = NULL;
+        FreeNode* right = detachMinNode(root->m_right, &successor);
+        successor->m_left = root->m_left;
+        successor->m_right = right;
+        return rebalance(successor);
+    }
+    if (nodeLess(node, root))
+    {
+        root->m_left = removeNode(root->m_left, node);
+    }
+    else
+    {
+        root->m_right = removeNode(root->m_right, node);
+    }
+    return rebalance(root);
+}
+
+//-- Smallest free block which fits, the lowest address among equal sizes
+static FreeNode* findBestFit(FreeNode* root, size_t size)
+{
+    FreeNode* best = NULL;
+    while (root != NULL)
+    {
+        if (blockSize(&root->m_header) >= size)
+        {
+            best = root;
+            root = root->m_left;
+        }
+        else
+        {
+            root = root->m_right;
+        }
+    }
+    return best;
+}
+
+static void updateLargestFree(BTagsHeap* heap)
+{
+    FreeNode* node = heap->m_freeTree;
+    while (node != NULL && node->m_right != NULL)
+    {
+        node = node->m_right;
+    }
+    heap->m_largestFree = node != NULL ? blockSize(&node->m_header) : 0;
+}
+
+static inline void indexFreeBlock(BlockHeader* header, BTagsHeap* heap)
+{
+    heap->m_freeTree = insertNode(heap->m_freeTree, (FreeNode*)(header));
+}
+
+//-- Tree node stays in the first page of the block and footer in the last one, pages between them
+//-- are purged. Returns 0 when there is no whole page
+static size_t purgeRangeOf(FreeNode* node, uintptr_t* start)
+{
+    *start = ((uintptr_t)(node) + sizeof(FreeNode) + purgePageSize - 1) & ~(purgePageSize - 1);
+    uintptr_t end = ((uintptr_t)(getFooter(&node->m_header))) & ~(purgePageSize - 1);
+    return end > *start ? end - *start : 0;
+}
+
+//-- Block leaving the tree is going to be written, so its purged pages are committed again
+static inline void unindexFreeBlock(BlockHeader* header, BTagsHeap* heap)
+{
+    heap->m_freeTree = removeNode(heap->m_freeTree, (FreeNode*)(header));
+    if (header->m_sizeAndFlags & BT_PURGED_BIT)
+    {
+        uintptr_t start = 0;
+        size_t    purged = purgeRangeOf((FreeNode*)(header), &start);
+        header->m_sizeAndFlags &= ~BT_PURGED_BIT;
+        heap->m_purgedSpace -= purged;
+        if (heap->m_space != NULL)
+        {
+            spaceReclaim(heap->m_space, purged, false);
+        }
+    }
+}
+
+//-- Size of the block (with header) able to keep requested size
+static size_t transformToBlockSize(size_t size)
+{
+    if (size > SIZE_MAX - minBlockSize)
+    {
+        return 0;
+    }
+    size_t withHeader = alignUpBT(size + headerSize);
+    return withHeader < minBlockSize ? minBlockSize : withHeader;
+}
+
+// Payloads are 16 bytes aligned, so every block starts 8 bytes before 16 bytes boundary
+static void initHeap(void* buf, size_t size, BTagsHeap* heap)
+{
+    heap->m_buffer = buf;
+    heap->m_bufferSize = size;
+
+    uintptr_t start = (uintptr_t)(buf);
+    uintptr_t end = start + size;
+    uintptr_t first = ((start + headerSize + blockAlignment - 1) & ~(blockAlignment - 1)) - headerSize;
+    uintptr_t endMarker = ((end - headerSize) & ~(blockAlignment - 1)) + headerSize;
+    if (endMarker + headerSize > end)
+    {
+        endMarker -= blockAlignment;
+    }
+
+    heap->m_firstBlock = (BlockHeader*)(first);
+    heap->m_endMarker = (BlockHeader*)(endMarker);
+    heap->m_endMarker->m_sizeAndFlags = 0;
+    heap->m_firstBlock->m_sizeAndFlags = 0;
+    heap->m_freeSpace = endMarker - first;
+    heap->m_freeTree = NULL;
+    heap->m_blocksArea = heap->m_freeSpace;
+    heap->m_quickSpace = 0;
+    heap->m_purgedSpace = 0;
+    heap->m_space = NULL;
+    for (int i = 0; i < BT_QUICK_LISTS; ++i)
+    {
+        heap->m_quickLists[i].m_head = NULL;
+        heap->m_quickLists[i].m_blockSize = 0;
+        heap->m_quickLists[i].m_count = 0;
+    }
+    markFree(heap->m_firstBlock, heap->m_freeSpace);
+    indexFreeBlock(heap->m_firstBlock, heap);
+    updateLargestFree(heap);
 }
 
 void setupBTagsAllocator(void* buf, size_t size, BTagsHeap* heap)
@@ -70,103 +307,305 @@ void setupBTagsAllocator(void* buf, size_t size, BTagsHeap* heap)
     initHeap(buf, size, heap);
 }
 
+size_t BTBlockSizeFor(size_t size)
+{
+    return transformToBlockSize(size);
+}
+
+size_t BTBufferSizeFor(size_t size)
+{
+    size_t needed = transformToBlockSize(size);
+    if (needed == 0 || needed > SIZE_MAX - 3 * blockAlignment)
+    {
+        return 0;
+    }
+    //-- alignment of the first block plus aligned end marker
+    return needed + 3 * blockAlignment;
+}
+
+bool BTIsEmpty(BTagsHeap* heap)
+{
+    return heap->m_freeSpace + heap->m_quickSpace == heap->m_blocksArea;
+}
+
+//-- Quick lists: used blocks linked through the first payload word
+static inline BlockHeader** quickLink(BlockHeader* header)
+{
+    return (BlockHeader**)payloadOf(header);
+}
+
+static QuickList* findQuickList(size_t size, BTagsHeap* heap)
+{
+    for (int i = 0; i < BT_QUICK_LISTS; ++i)
+    {
+        if (heap->m_quickLists[i].m_count != 0 && heap->m_quickLists[i].m_blockSize == size)
+        {
+            return &heap->m_quickLists[i];
+        }
+    }
+    return NULL;
+}
+
+static QuickList* findEmptyQuickList(BTagsHeap* heap)
+{
+    for (int i = 0; i < BT_QUICK_LISTS; ++i)
+    {
+        if (heap->m_quickLists[i].m_count == 0)
+        {
+            return &heap->m_quickLists[i];
+        }
+    }
+    return NULL;
+}
+
+//-- Parks block in a quick list, false if it has to be coalesced right now
+static bool pushToQuickList(BlockHeader* header, BTagsHeap* heap)
+{
+    size_t size = blockSize(header);
+    if (heap->m_quickSpace + size > heap->m_blocksArea / 4)
+    {
+        return false;
+    }
+    QuickList* list = findQuickList(size, heap);
+    if (list == NULL)
+    {
+        list = findEmptyQuickList(heap);
+    }
+    if (list == NULL || list->m_count == BT_QUICK_LIST_LENGTH)
+    {
+        return false;
+    }
+    header->m_sizeAndFlags |= BT_QUICK_BIT;
+    *quickLink(header) = list->m_head;
+    list->m_head = header;
+    list->m_blockSize = size;
+    ++list->m_count;
+    heap->m_quickSpace += size;
+    return true;
+}
+
+void* BTAllocFromQuickList(size_t size, BTagsHeap* heap)
+{
+    size_t     neededSize = transformToBlockSize(size);
+    QuickList* list = neededSize != 0 ? findQuickList(neededSize, heap) : NULL;
+    if (list == NULL)
+    {
+        return NULL;
+    }
+    BlockHeader* block = list->m_head;
+    list->m_head = *quickLink(block);
+    --list->m_count;
+    heap->m_quickSpace -= neededSize;
+    block->m_sizeAndFlags &= ~BT_QUICK_BIT;
+    return payloadOf(block);
+}
+
 // Preparing block for return, if it's too big, we will cut part of it to return
-// and leave in allocator another part
-void cutTheBlockToFit(BlockHeader* iterator, size_t requestedSize)
+// and leave in allocator another part, block has to be already removed from the tree
+static void cutTheBlockToFit(BlockHeader* iterator, size_t neededSize, BTagsHeap* heap)
 {
-    size_t sizeToCut = requestedSize + headerFooterSize;
-    // in case of new block is gonna be smaller, than size of (metdata + one_void_pointer_size) size
-    // we won't cut
-    if ((int64_t)(iterator->m_blockSize - sizeToCut) <= minBlockSize)
+    size_t currentSize = blockSize(iterator);
+    size_t prevFreeFlag = iterator->m_sizeAndFlags & BT_PREV_FREE_BIT;
+
+    // in case of rest is gonna be smaller than minimal free block we won't cut
+    if (currentSize - neededSize < minBlockSize)
     {
-        iterator->m_isFree = false;
-        getFooter(iterator)->m_isFree = false;
+        iterator->m_sizeAndFlags = currentSize | prevFreeFlag;
+        setPrevFree(getNextBlock(iterator), false);
         return;
     }
 
-    size_t newBlockSize = iterator->m_blockSize - sizeToCut;
+    iterator->m_sizeAndFlags = neededSize | prevFreeFlag;
 
-    // iterator is a pointer to an old block
-    iterator->m_blockSize = requestedSize;
-    iterator->m_isFree = false;
+    // setting up new block, next block already knows its previous is free
+    BlockHeader* newBlock = getNextBlock(iterator);
+    newBlock->m_sizeAndFlags = 0;
+    markFree(newBlock, currentSize - neededSize);
+    indexFreeBlock(newBlock, heap);
+}
+
+// Joins freed block with free neighbours, returns header of the joined block
+static BlockHeader* defragmentationAlgorithm(BlockHeader* iterator, BTagsHeap* heap)
+{
+    size_t size = blockSize(iterator);
 
-    // Setting up an old block
-    BlockFooter* newFooter = getFooter(iterator);
-    newFooter->m_isFree = false;
-    newFooter->m_blockSize = requestedSize;
+    // join previous block, it can't be free twice in a row since we join on every free
+    if (iterator != heap->m_firstBlock && isPrevFree(iterator))
+    {
+        iterator = getPrevBlock(iterator);
+        unindexFreeBlock(iterator, heap);
+        size += blockSize(iterator);
+    }
 
-    // setting up new block
-    BlockHeader* newBlock = (BlockHeader*)blockFooterShift((void*)newFooter);
-    newBlock->m_isFree = true;
-    newBlock->m_blockSize = newBlockSize;
+    // join next block
+    BlockHeader* next = (BlockHeader*)((byte*)(iterator) + size);
+    if (next != heap->m_endMarker && isFree(next))
+    {
+        unindexFreeBlock(next, heap);
+        size += blockSize(next);
+    }
 
-    BlockFooter* currentFooter = getFooter(newBlock);
-    currentFooter->m_blockSize = newBlockSize;
+    if (size != blockSize(iterator))
+    {
+        TRACE_EVENT(TE_Coalesce, size);
+    }
+    markFree(iterator, size);
+    indexFreeBlock(iterator, heap);
+    return iterator;
 }
 
-void defragmentationAlgorithm(BlockHeader* iterator, BTagsHeap* heap)
+void BTFlushQuickLists(BTagsHeap* heap)
 {
-    // join all previous blocks
-    BlockFooter* currFooter = getFooter(iterator);
-    while (iterator != heap->m_firstBlock)
+    for (int i = 0; i < BT_QUICK_LISTS && heap->m_quickSpace != 0; ++i)
     {
-        BlockFooter* prevFooter = (BlockFooter*)((byte*)iterator - headerSize);
-        if (!prevFooter->m_isFree)
+        QuickList* list = &heap->m_quickLists[i];
+        while (list->m_head != NULL)
         {
-            break;
+            BlockHeader* block = list->m_head;
+            list->m_head = *quickLink(block);
+            block->m_sizeAndFlags &= ~BT_QUICK_BIT;
+            heap->m_quickSpace -= blockSize(block);
+            heap->m_freeSpace += blockSize(block);
+            defragmentationAlgorithm(block, heap);
         }
-
-        iterator = getHeader(prevFooter);
-        iterator->m_blockSize = ((byte*)currFooter - (byte*)iterator) - headerSize;
-        currFooter->m_blockSize = iterator->m_blockSize;
+        list->m_count = 0;
     }
+    updateLargestFree(heap);
+}
+
+//-- Old end marker becomes the header of a block spanning the new space, freeing the block
+//-- joins it with the free block before it
+void BTExtend(BTagsHeap* heap, size_t growth)
+{
+    growth &= ~(blockAlignment - 1);
+    BlockHeader* block = heap->m_endMarker;
+    heap->m_endMarker = (BlockHeader*)((byte*)(block) + growth);
+    heap->m_endMarker->m_sizeAndFlags = 0;
+    heap->m_bufferSize += growth;
+    heap->m_blocksArea += growth;
+    heap->m_freeSpace += growth;
+    block->m_sizeAndFlags = growth | (block->m_sizeAndFlags & BT_PREV_FREE_BIT);
+    defragmentationAlgorithm(block, heap);
+    updateLargestFree(heap);
+}
 
-    // join all ahead blocks
-    while (currFooter != heap->m_lastFooter)
+void BTCollectStats(BTagsHeap* heap, BTagsStats* stats)
+{
+    BTagsStats result = {0};
+    for (BlockHeader* block = heap->m_firstBlock; block != heap->m_endMarker; block = getNextBlock(block))
     {
-        BlockHeader* nextHeader = (BlockHeader*)((byte*)currFooter + footerSize);
-        if (!nextHeader->m_isFree)
+        size_t size = blockSize(block);
+        if (isFree(block))
         {
-            break;
+            ++result.m_freeBlocks;
+            result.m_freeBytes += size;
+            result.m_largestFree = size > result.m_largestFree ? size : result.m_largestFree;
+        }
+        else if (block->m_sizeAndFlags & BT_QUICK_BIT)
+        {
+            ++result.m_quickBlocks;
+            result.m_quickBytes += size;
+        }
+        else
+        {
+            ++result.m_usedBlocks;
+            result.m_usedBytes += size;
         }
-
-        currFooter = getFooter(nextHeader);
-        currFooter->m_blockSize = ((byte*)currFooter - (byte*)iterator) - headerSize;
-        iterator->m_blockSize = currFooter->m_blockSize;
     }
+    *stats = result;
 }
 
-// Allocation function
+// Allocation function: exact size from quick lists, then best fit, then best fit after
+// coalescing of quick lists
 void* BTAlloc(size_t size, BTagsHeap* heap)
 {
-    if ((size_t)(heap->m_freeSpace) < size)
+    void* quickBlock = BTAllocFromQuickList(size, heap);
+    if (quickBlock != NULL)
+    {
+        return quickBlock;
+    }
+
+    size_t neededSize = transformToBlockSize(size);
+    if (neededSize == 0)
+    {
+        return NULL;
+    }
+    if (heap->m_largestFree < neededSize && heap->m_quickSpace != 0)
+    {
+        BTFlushQuickLists(heap);
+    }
+    if (heap->m_largestFree < neededSize)
     {
         return NULL;
     }
 
-    BlockHeader* blockItepator = heap->m_firstBlock;
+    FreeNode* bestFit = findBestFit(heap->m_freeTree, neededSize);
 
-    while (blockItepator != NULL)
+    // prepare block for allocation, at least we have to mark it as used
+    BlockHeader* block = &bestFit->m_header;
+    unindexFreeBlock(block, heap);
+    cutTheBlockToFit(block, neededSize, heap);
+    heap->m_freeSpace -= blockSize(block);
+    updateLargestFree(heap);
+    return payloadOf(block);
+}
+
+// Free function, double free is ignored, coalescing is deferred while block fits in quick list
+void BTFree(void* p, BTagsHeap* heap)
+{
+    BlockHeader* header = (BlockHeader*)((byte*)(p) - headerSize);
+    if (header->m_sizeAndFlags & (BT_FREE_BIT | BT_QUICK_BIT))
+    {
+        return;
+    }
+    if (blockSize(header) <= BT_QUICK_MAX_BLOCK)
     {
-        if (blockItepator->m_isFree && (size_t)(blockItepator->m_blockSize) >= size)
+        if (pushToQuickList(header, heap))
         {
-            // prepare block for allocation, at least we have to mark it as used
-            cutTheBlockToFit(blockItepator, size);
-            heap->m_freeSpace -= transformToSizeWithTags(size);
-            return (void*)((byte*)(blockItepator) + sizeof(BlockHeader));
+            return;
         }
-        blockItepator = getNextBlock(blockItepator, heap);
+        //-- Quick lists hit their bound, give all parked blocks back as well
+        BTFlushQuickLists(heap);
     }
-    return NULL;
+    heap->m_freeSpace += blockSize(header);
+    defragmentationAlgorithm(header, heap);
+    updateLargestFree(heap);
 }
 
-// Free function
-void BTFree(void* p, BTagsHeap* heap)
+static size_t purgeNode(FreeNode* node, BTagsHeap* heap)
 {
-    BlockHeader* header = (BlockHeader*)((byte*)(p) - sizeof(BlockHeader));
-    header->m_isFree = true;
-    BlockFooter* footer = (BlockFooter*)((byte*)(p) + header->m_blockSize);
-    footer->m_isFree = true;
-    heap->m_freeSpace += transformToSizeWithTags(header->m_blockSize);
-    defragmentationAlgorithm(header, heap);
+    if (node == NULL)
+    {
+        return 0;
+    }
+    size_t       purged = purgeNode(node->m_left, heap) + purgeNode(node->m_right, heap);
+    BlockHeader* header = &node->m_header;
+    uintptr_t    start = 0;
+    size_t       size = purgeRangeOf(node, &start);
+    if ((header->m_sizeAndFlags & BT_PURGED_BIT) || size == 0)
+    {
+        return purged;
+    }
+    if (heap->m_space != NULL)
+    {
+        spaceDiscard(heap->m_space, (void*)(start), size);
+    }
+    else if (madvise((void*)(start), size, MADV_DONTNEED) != 0)
+    {
+        return purged;
+    }
+    header->m_sizeAndFlags |= BT_PURGED_BIT;
+    heap->m_purgedSpace += size;
+    return purged + size;
+}
+
+void BTUseAddressSpace(BTagsHeap* heap, AddressSpace* space)
+{
+    heap->m_space = space;
+}
+
+size_t BTPurgeFreePages(BTagsHeap* heap)
+{
+    BTFlushQuickLists(heap);
+    return purgeNode(heap->m_freeTree, heap);
 }
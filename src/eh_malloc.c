@@ -1,29 +1,115 @@
-#include <eh_malloc.h>
-#define _GNU_SOURCE
-#include <sys/mman.h>
-#undef _GNU_SOURCE
+#include <eh_heap.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <time.h>
 
 typedef unsigned char byte;
 
-const size_t smallSlabSize = 64;
-const size_t mediumSlabSize = 512;
-const size_t bigSlabSize = 4096;
+const size_t smallSlabSize = EH_SMALL_SLAB_SIZE;
+const size_t mediumSlabSize = EH_MEDIUM_SLAB_SIZE;
+const size_t bigSlabSize = EH_BIG_SLAB_SIZE;
 const int    sizeOfPage = 4096;
 const int    initialOrderForBT = 5;
+//-- Virtual range reserved for all slabs and BT heaps
+const size_t spaceSize = (size_t)1 << 36;
+//-- Memory unused for this count of purge ticks is given back, tick is decay / purgeDecayTicks
+const unsigned purgeDecayTicks = 4;
+//-- Bounds of retained BT heaps: size of one mapping and total size
+const size_t retainedMaxMapping = (size_t)16 << 20;
+const size_t retainedMaxBytes = (size_t)64 << 20;
+//-- BT heaps double up to this size, by count of heaps for new ones and in place for the last one
+const size_t btMaxGrowSize = (size_t)8 << 20;
 
-static void  initHeap(GlobalHeap* heap);
-static void* allocInBT(size_t size, GlobalHeap* heap);
-static void  freeInBT(void* address, GlobalHeap* heap);
+static void           ensureHeap(GlobalHeap* heap);
+static void           initHeap(GlobalHeap* heap);
+static void*          allocInBT(size_t size, GlobalHeap* heap);
+static void           freeInBT(void* address, GlobalHeap* heap);
+static void           freeUnreserved(void* address, GlobalHeap* heap);
+static BTagHeapsList* mapBTHeap(size_t size, bool populate);
+static void           reclaimPurgedPages(BTagHeapsList* node, GlobalHeap* heap);
+static size_t         residentSize(BTagHeapsList* node);
+static BTagHeapsList* newBTHeap(size_t bufferSize, bool populate, GlobalHeap* heap);
+static void           rebinBTHeap(BTagHeapsList* node, GlobalHeap* heap);
+static void           unbinBTHeap(BTagHeapsList* node, GlobalHeap* heap);
+static void           releaseBTHeap(BTagHeapsList* node, GlobalHeap* heap);
+static void           retainBTHeap(BTagHeapsList* node, GlobalHeap* heap);
+static BTagHeapsList* takeRetainedBTHeap(size_t mappingSize, GlobalHeap* heap);
+static size_t         releaseRetainedBTHeaps(GlobalHeap* heap, unsigned age);
+static void           purgeBTHeaps(GlobalHeap* heap, unsigned age);
+static size_t         getMappingSize(BTagHeapsList* node);
+static void           relievePressure(PressureStage stage, size_t size, GlobalHeap* heap);
+
+__thread ThreadCache eh_thread_cache;
 
 static GlobalHeap* heapSingleton()
 {
     static GlobalHeap heap = {
-        .m_cacheSmall = {}, .m_cacheMedium = {}, .m_cacheBig = {}, .m_btHeaps = NULL, .m_onInit = true};
+        .m_cacheSmall = {},
+        .m_cacheMedium = {},
+        .m_cacheBig = {},
+        .m_btHeaps = NULL,
+        .m_initOnce = PTHREAD_ONCE_INIT,
+        .m_btLock = PTHREAD_MUTEX_INITIALIZER,
+        .m_mutex = PTHREAD_MUTEX_INITIALIZER};
     return &heap;
 }
 
+//-- Without reserved range (low RLIMIT_AS) slabs and BT heaps are mapped one span at a time
+static inline bool hasSpace(GlobalHeap* heap)
+{
+    return heap->m_space.m_base != NULL;
+}
+
+//-- Slab cache serving the size, NULL for sizes served by BT heaps
+static Cache* cacheForSize(size_t size, GlobalHeap* heap)
+{
+    if (size <= smallSlabSize)
+    {
+        return &heap->m_cacheSmall;
+    }
+    else if (size <= mediumSlabSize)
+    {
+        return &heap->m_cacheMedium;
+    }
+    else if (size <= bigSlabSize)
+    {
+        return &heap->m_cacheBig;
+    }
+    return NULL;
+}
+
+//-- Slab caches are lock free, only BT heaps are under their lock
+static void* allocate(size_t size, GlobalHeap* heap)
+{
+    Cache* cache = cacheForSize(size, heap);
+    if (cache != NULL)
+    {
+        return cacheAlloc(cache);
+    }
+    traceLock(&heap->m_btLock);
+    void* result = allocInBT(size, heap);
+    pthread_mutex_unlock(&heap->m_btLock);
+    return result;
+}
+
+//-- Owner is searched through slab lists of every cache, then through BT heaps
+static void freeUnreserved(void* address, GlobalHeap* heap)
+{
+    Cache* caches[] = {&heap->m_cacheSmall, &heap->m_cacheMedium, &heap->m_cacheBig};
+    for (int i = 0; i < 3; ++i)
+    {
+        if (hasAddressInCache(address, caches[i]))
+        {
+            cacheFree(caches[i], address);
+            return;
+        }
+    }
+    traceLock(&heap->m_btLock);
+    freeInBT(address, heap);
+    pthread_mutex_unlock(&heap->m_btLock);
+}
+
 //-- API for malloc and free
 void* eh_malloc(size_t size)
 {
@@ -32,190 +118,930 @@ void* eh_malloc(size_t size)
         return NULL;
     }
     GlobalHeap* heap = heapSingleton();
-    pthread_mutex_lock(&heap->m_mutex);
-    void* result = NULL;
+    ensureHeap(heap);
 
-    if (heap->m_onInit)
+    void* result = allocate(size, heap);
+    //-- Over the memory limit: shrink our own caches first, then ask the application
+    for (int stage = 0; result == NULL && stage < PS_Count && atomic_load(&heap->m_memoryLimit) != 0; ++stage)
     {
-        initHeap(heap);
+        relievePressure((PressureStage)(stage), size, heap);
+        result = allocate(size, heap);
     }
-    if (size <= smallSlabSize)
+    return result;
+}
+
+void eh_free(void* address)
+{
+    if (address == NULL)
     {
-        result = cacheAlloc(&heap->m_cacheSmall);
+        return;
     }
-    else if (size <= mediumSlabSize)
+    GlobalHeap* heap = heapSingleton();
+    if (!hasSpace(heap))
     {
-        result = cacheAlloc(&heap->m_cacheMedium);
+        freeUnreserved(address, heap);
+        return;
     }
-    else if (size <= bigSlabSize)
+    //-- Pointers out of the address space are not ours
+    if (!spaceContains(&heap->m_space, address))
     {
-        result = cacheAlloc(&heap->m_cacheBig);
+        return;
     }
-    else
+    SpanKind   kind = SK_None;
+    CSlabData* slab = (CSlabData*)spaceOwnerOf(&heap->m_space, address, &kind);
+    if (kind == SK_Slab)
     {
-        result = allocInBT(size, heap);
+        cacheFreeToSlab(slab->m_cache, slab, address);
+        return;
     }
-    pthread_mutex_unlock(&heap->m_mutex);
-    return result;
+    traceLock(&heap->m_btLock);
+    freeInBT(address, heap);
+    pthread_mutex_unlock(&heap->m_btLock);
 }
 
-void eh_free(void* address)
+void eh_free_sized(void* address, size_t size)
 {
-    if (address == NULL)
+    GlobalHeap* heap = heapSingleton();
+    if (address == NULL || !spaceContains(&heap->m_space, address))
+    {
+        eh_free(address);
+        return;
+    }
+    //-- Size only confirms the owner, wrong one goes the generic way instead of to a foreign cache
+    SpanKind   kind = SK_None;
+    CSlabData* slab = (CSlabData*)spaceOwnerOf(&heap->m_space, address, &kind);
+    if (kind != SK_Slab || size == 0 || slab->m_cache != cacheForSize(size, heap))
     {
+        eh_free(address);
         return;
     }
+    cacheFreeToSlab(slab->m_cache, slab, address);
+}
+
+//-- Thread caches of the inline fast path, classes follow cacheForSize
+static Cache* cacheOfClass(int sizeClass, GlobalHeap* heap)
+{
+    Cache* caches[EH_THREAD_CACHE_CLASSES] = {&heap->m_cacheSmall, &heap->m_cacheMedium, &heap->m_cacheBig};
+    return caches[sizeClass];
+}
+
+static void flushThreadCache(ThreadCache* threadCache)
+{
     GlobalHeap* heap = heapSingleton();
-    pthread_mutex_lock(&heap->m_mutex);
-    if (hasAddressInCache(address, &heap->m_cacheSmall))
+    for (int i = 0; i < EH_THREAD_CACHE_CLASSES; ++i)
     {
-        cacheFree(&heap->m_cacheSmall, address);
+        while (threadCache->m_heads[i] != NULL)
+        {
+            void* block = threadCache->m_heads[i];
+            threadCache->m_heads[i] = *(void**)(block);
+            cacheFree(cacheOfClass(i, heap), block);
+        }
+        threadCache->m_counts[i] = 0;
     }
-    else if (hasAddressInCache(address, &heap->m_cacheMedium))
+}
+
+//-- Destructors of other keys may still free blocks, they must not land in lists nobody flushes
+static void threadCacheDestructor(void* threadCache)
+{
+    flushThreadCache((ThreadCache*)(threadCache));
+    ((ThreadCache*)(threadCache))->m_registered = false;
+    ((ThreadCache*)(threadCache))->m_exited = true;
+}
+
+void* eh_thread_cache_refill(int sizeClass)
+{
+    GlobalHeap* heap = heapSingleton();
+    ensureHeap(heap);
+    ThreadCache* threadCache = &eh_thread_cache;
+    if (!threadCache->m_registered && !threadCache->m_exited)
     {
-        cacheFree(&heap->m_cacheMedium, address);
+        threadCache->m_registered = pthread_setspecific(heap->m_threadCacheKey, threadCache) == 0;
     }
-    else if (hasAddressInCache(address, &heap->m_cacheBig))
+
+    //-- One block goes to the caller, half of the list is filled for next calls
+    static const size_t classSizes[EH_THREAD_CACHE_CLASSES] = {smallSlabSize, mediumSlabSize, bigSlabSize};
+    void*               result = eh_malloc(classSizes[sizeClass]);
+    Cache*              cache = cacheOfClass(sizeClass, heap);
+    while (result != NULL && threadCache->m_registered && threadCache->m_counts[sizeClass] < EH_THREAD_CACHE_LENGTH / 2)
     {
-        cacheFree(&heap->m_cacheBig, address);
+        void* block = cacheAlloc(cache);
+        if (block == NULL)
+        {
+            break;
+        }
+        *(void**)(block) = threadCache->m_heads[sizeClass];
+        threadCache->m_heads[sizeClass] = block;
+        ++threadCache->m_counts[sizeClass];
     }
-    else
+    return result;
+}
+
+void eh_thread_cache_flush()
+{
+    flushThreadCache(&eh_thread_cache);
+}
+
+//-- Over-aligned blocks keep the pointer given by eh_malloc right before the aligned address
+void* eh_malloc_aligned(size_t size, size_t alignment)
+{
+    if (alignment <= EH_MALLOC_ALIGNMENT)
+    {
+        return eh_malloc(size);
+    }
+    if ((alignment & (alignment - 1)) != 0 || size > SIZE_MAX - alignment - sizeof(void*))
+    {
+        return NULL;
+    }
+    void* memory = eh_malloc(size + alignment + sizeof(void*));
+    if (memory == NULL)
+    {
+        return NULL;
+    }
+    uintptr_t aligned = ((uintptr_t)(memory) + sizeof(void*) + alignment - 1) & ~(alignment - 1);
+    ((void**)(aligned))[-1] = memory;
+    return (void*)(aligned);
+}
+
+void eh_free_aligned(void* address, size_t alignment)
+{
+    if (address != NULL && alignment > EH_MALLOC_ALIGNMENT)
+    {
+        address = ((void**)(address))[-1];
+    }
+    eh_free(address);
+}
+
+//-- Reserve API, reserved memory is never given back automatically
+bool eh_reserve_slabs(size_t objectSize, size_t slabCount, int flags)
+{
+    GlobalHeap* heap = heapSingleton();
+    ensureHeap(heap);
+    Cache* cache = objectSize != 0 ? cacheForSize(objectSize, heap) : NULL;
+    return cache != NULL && cacheReserve(cache, slabCount, flags & EH_RESERVE_POPULATE);
+}
+
+bool eh_reserve_large(size_t bytes, int flags)
+{
+    size_t bufferSize = BTBufferSizeFor(bytes);
+    if (bytes == 0 || bufferSize == 0)
+    {
+        return false;
+    }
+    GlobalHeap* heap = heapSingleton();
+    ensureHeap(heap);
+    traceLock(&heap->m_btLock);
+    BTagHeapsList* node = newBTHeap(bufferSize, flags & EH_RESERVE_POPULATE, heap);
+    if (node != NULL)
+    {
+        node->m_pinned = true;
+    }
+    pthread_mutex_unlock(&heap->m_btLock);
+    return node != NULL;
+}
+
+//-- Background purge
+static void setCachesAutoShrink(GlobalHeap* heap, bool autoShrink)
+{
+    atomic_store(&heap->m_cacheSmall.m_autoShrink, autoShrink);
+    atomic_store(&heap->m_cacheMedium.m_autoShrink, autoShrink);
+    atomic_store(&heap->m_cacheBig.m_autoShrink, autoShrink);
+}
+
+//-- Heaps idle for age ticks give back free pages, such empty heaps are released (except the oldest one)
+static void purgeBTHeaps(GlobalHeap* heap, unsigned age)
+{
+    releaseRetainedBTHeaps(heap, age);
+    BTagHeapsList* iterator = heap->m_btHeaps;
+    while (iterator != NULL)
+    {
+        BTagHeapsList* next = iterator->m_next;
+        if (!iterator->m_pinned && heap->m_btEpoch - iterator->m_lastUse >= age)
+        {
+            if (iterator->m_next != NULL && BTIsEmpty(&iterator->m_heap))
+            {
+                releaseBTHeap(iterator, heap);
+            }
+            else
+            {
+                BTPurgeFreePages(&iterator->m_heap);
+                rebinBTHeap(iterator, heap);
+            }
+        }
+        iterator = next;
+    }
+}
+
+//-- Unlike purge, trim releases the last heap of the list as well. Free BT memory up to pad
+//-- bytes is left as it is
+static size_t trimBTHeaps(GlobalHeap* heap, size_t pad)
+{
+    size_t         released = releaseRetainedBTHeaps(heap, 0);
+    BTagHeapsList* iterator = heap->m_btHeaps;
+    while (iterator != NULL)
+    {
+        BTagHeapsList* next = iterator->m_next;
+        size_t         freeSpace = iterator->m_heap.m_freeSpace + iterator->m_heap.m_quickSpace;
+        if (!iterator->m_pinned)
+        {
+            if (BTIsEmpty(&iterator->m_heap) && getMappingSize(iterator) > pad)
+            {
+                released += residentSize(iterator);
+                releaseBTHeap(iterator, heap);
+            }
+            else if (freeSpace > pad)
+            {
+                released += BTPurgeFreePages(&iterator->m_heap);
+                rebinBTHeap(iterator, heap);
+            }
+            else
+            {
+                pad -= freeSpace;
+            }
+        }
+        iterator = next;
+    }
+    return released;
+}
+
+static void* purgeThread(void* arg)
+{
+    GlobalHeap* heap = (GlobalHeap*)(arg);
+    traceLock(&heap->m_mutex);
+    while (heap->m_purgeRunning)
     {
-        freeInBT(address, heap);
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += heap->m_purgeTickMs / 1000;
+        deadline.tv_nsec += (long)(heap->m_purgeTickMs % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&heap->m_purgeCond, &heap->m_mutex, &deadline);
+        if (!heap->m_purgeRunning)
+        {
+            break;
+        }
+        traceLock(&heap->m_btLock);
+        ++heap->m_btEpoch;
+        purgeBTHeaps(heap, purgeDecayTicks);
+        pthread_mutex_unlock(&heap->m_btLock);
+
+        //-- Slab caches have their own locks
+        pthread_mutex_unlock(&heap->m_mutex);
+        cachePurge(&heap->m_cacheSmall, purgeDecayTicks);
+        cachePurge(&heap->m_cacheMedium, purgeDecayTicks);
+        cachePurge(&heap->m_cacheBig, purgeDecayTicks);
+        traceLock(&heap->m_mutex);
     }
     pthread_mutex_unlock(&heap->m_mutex);
+    return NULL;
 }
 
-//-- Initialization of global heap
-static void initHeap(GlobalHeap* heap)
+bool eh_purge_start(unsigned decayMs)
 {
-    pthread_mutex_init(&heap->m_mutex, NULL);
-    pthread_mutex_lock(&heap->m_mutex);
+    GlobalHeap* heap = heapSingleton();
+    ensureHeap(heap);
+    traceLock(&heap->m_mutex);
+    if (heap->m_purgeRunning)
+    {
+        pthread_mutex_unlock(&heap->m_mutex);
+        return false;
+    }
+    heap->m_purgeTickMs = decayMs / purgeDecayTicks > 0 ? decayMs / purgeDecayTicks : 1;
+    heap->m_purgeRunning = true;
+    setCachesAutoShrink(heap, false);
+    if (pthread_create(&heap->m_purgeThread, NULL, purgeThread, heap) != 0)
+    {
+        heap->m_purgeRunning = false;
+        setCachesAutoShrink(heap, true);
+    }
+    bool result = heap->m_purgeRunning;
+    pthread_mutex_unlock(&heap->m_mutex);
+    return result;
+}
+
+void eh_purge_stop()
+{
+    GlobalHeap* heap = heapSingleton();
+    traceLock(&heap->m_mutex);
+    if (!heap->m_purgeRunning)
+    {
+        pthread_mutex_unlock(&heap->m_mutex);
+        return;
+    }
+    heap->m_purgeRunning = false;
+    pthread_cond_signal(&heap->m_purgeCond);
+    pthread_mutex_unlock(&heap->m_mutex);
+    pthread_join(heap->m_purgeThread, NULL);
+    setCachesAutoShrink(heap, true);
+}
 
-    cacheSetup(&heap->m_cacheSmall, smallSlabSize);
-    cacheSetup(&heap->m_cacheMedium, mediumSlabSize);
-    cacheSetup(&heap->m_cacheBig, bigSlabSize);
+//-- Memory limit
+void eh_set_memory_limit(size_t bytes)
+{
+    GlobalHeap* heap = heapSingleton();
+    ensureHeap(heap);
+    spaceSetLimit(&heap->m_space, bytes);
+    atomic_store(&heap->m_memoryLimit, bytes);
+}
 
-    size_t sizeForBt = sizeOfPage * (1UL << initialOrderForBT);
-    heap->m_btHeaps = mmapWrapperForBT(sizeForBt);
+size_t eh_mapped_bytes()
+{
+    GlobalHeap* heap = heapSingleton();
+    ensureHeap(heap);
+    return spaceCommitted(&heap->m_space);
+}
 
-    size_t bufferSize = sizeForBt - sizeof(BTagHeapsList) - sizeof(BTagHeapsList*) - sizeof(BTagsHeap);
-    byte*  addressOfBuffer = ((byte*)heap->m_btHeaps) + sizeof(BTagsHeap) + sizeof(BTagHeapsList*);
-    setupBTagsAllocator(addressOfBuffer, bufferSize, &heap->m_btHeaps->m_heap);
+bool eh_add_pressure_callback(PressureCallback callback, void* arg)
+{
+    GlobalHeap* heap = heapSingleton();
+    ensureHeap(heap);
+    traceLock(&heap->m_mutex);
+    bool result = callback != NULL && heap->m_pressureCallbacksCount < EH_PRESSURE_CALLBACKS;
+    if (result)
+    {
+        heap->m_pressureCallbacks[heap->m_pressureCallbacksCount] = callback;
+        heap->m_pressureArgs[heap->m_pressureCallbacksCount] = arg;
+        ++heap->m_pressureCallbacksCount;
+    }
+    pthread_mutex_unlock(&heap->m_mutex);
+    return result;
+}
 
-    heap->m_onInit = false;
+//-- Called without locks, callbacks may use the allocator
+static void relievePressure(PressureStage stage, size_t size, GlobalHeap* heap)
+{
+    if (stage == PS_Shrink)
+    {
+        flushThreadCache(&eh_thread_cache);
+        cacheShrink(&heap->m_cacheSmall);
+        cacheShrink(&heap->m_cacheMedium);
+        cacheShrink(&heap->m_cacheBig);
+        traceLock(&heap->m_btLock);
+        purgeBTHeaps(heap, 0);
+        pthread_mutex_unlock(&heap->m_btLock);
+        return;
+    }
 
+    PressureCallback callbacks[EH_PRESSURE_CALLBACKS];
+    void*            args[EH_PRESSURE_CALLBACKS];
+    traceLock(&heap->m_mutex);
+    int count = heap->m_pressureCallbacksCount;
+    for (int i = 0; i < count; ++i)
+    {
+        callbacks[i] = heap->m_pressureCallbacks[i];
+        args[i] = heap->m_pressureArgs[i];
+    }
     pthread_mutex_unlock(&heap->m_mutex);
+    for (int i = 0; i < count; ++i)
+    {
+        callbacks[i](size, args[i]);
+    }
 }
 
-//-- Operations with BTAllocator
-static void* mmapWrapperForBT(size_t size)
+size_t eh_trim(size_t pad)
+{
+    GlobalHeap* heap = heapSingleton();
+    ensureHeap(heap);
+    flushThreadCache(&eh_thread_cache);
+
+    //-- Slab bodies are discarded through the space, so its counter shows what they gave back
+    size_t committed = spaceCommitted(&heap->m_space);
+    cacheShrink(&heap->m_cacheSmall);
+    cacheShrink(&heap->m_cacheMedium);
+    cacheShrink(&heap->m_cacheBig);
+    size_t shrunk = spaceCommitted(&heap->m_space);
+    size_t released = committed > shrunk ? committed - shrunk : 0;
+
+    traceLock(&heap->m_btLock);
+    released += trimBTHeaps(heap, pad);
+    pthread_mutex_unlock(&heap->m_btLock);
+    return released;
+}
+
+//-- Object cache API, cache itself lives in the heap and its slabs in the address space
+Cache* eh_cache_create(size_t objectSize, size_t align, CacheObjectCallback ctor, CacheObjectCallback dtor,
+                       void* arg)
+{
+    GlobalHeap* heap = heapSingleton();
+    Cache*      cache = (Cache*)eh_malloc(sizeof(Cache));
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+    if (!cacheSetupObjects(cache, objectSize, align, ctor, dtor, arg))
+    {
+        eh_free(cache);
+        return NULL;
+    }
+    if (hasSpace(heap))
+    {
+        cacheUseAddressSpace(cache, &heap->m_space);
+    }
+    return cache;
+}
+
+void* eh_cache_alloc(Cache* cache)
+{
+    return cacheAlloc(cache);
+}
+
+void eh_cache_free(Cache* cache, void* object)
+{
+    if (object != NULL)
+    {
+        cacheFree(cache, object);
+    }
+}
+
+void eh_cache_shrink(Cache* cache)
+{
+    cacheShrink(cache);
+}
+
+void eh_cache_destroy(Cache* cache)
+{
+    if (cache == NULL)
+    {
+        return;
+    }
+    cacheRelease(cache);
+    pthread_mutex_destroy(&cache->m_lock);
+    eh_free(cache);
+}
+
+//-- Initialization of global heap, once callback takes no argument
+static void initHeapOnce()
+{
+    initHeap(heapSingleton());
+}
+
+static void ensureHeap(GlobalHeap* heap)
 {
-    size_t sizeForBT = size + sizeof(BTagHeapsList) + sizeof(BTagHeapsList*) + sizeof(BTagsHeap) + sizeof(BlockFooter) +
-                       sizeof(BlockHeader);
-    return mmap(NULL, sizeForBT, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    pthread_once(&heap->m_initOnce, initHeapOnce);
 }
 
+static void initHeap(GlobalHeap* heap)
+{
+    pthread_key_create(&heap->m_threadCacheKey, threadCacheDestructor);
+
+    pthread_condattr_t condAttr;
+    pthread_condattr_init(&condAttr);
+    pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+    pthread_cond_init(&heap->m_purgeCond, &condAttr);
+    pthread_condattr_destroy(&condAttr);
+
+    cacheSetupWithLayout(&heap->m_cacheSmall, smallSlabSize, SL_Bitmap);
+    cacheSetupWithLayout(&heap->m_cacheMedium, mediumSlabSize, SL_Bitmap);
+    cacheSetupWithLayout(&heap->m_cacheBig, bigSlabSize, SL_Bitmap);
+    //-- Space base stays NULL when even the smallest range can't be reserved
+    if (spaceInit(&heap->m_space, spaceSize))
+    {
+        cacheUseAddressSpace(&heap->m_cacheSmall, &heap->m_space);
+        cacheUseAddressSpace(&heap->m_cacheMedium, &heap->m_space);
+        cacheUseAddressSpace(&heap->m_cacheBig, &heap->m_space);
+    }
+
+    newBTHeap(sizeOfPage * (1UL << initialOrderForBT), false, heap);
+}
+
+//-- Operations with BTAllocator
 inline static void* calculateAddresOfBuffer(BTagHeapsList* newBTNode)
 {
-    return ((byte*)newBTNode) + sizeof(BTagsHeap) + sizeof(BTagHeapsList*);
+    return ((byte*)newBTNode) + sizeof(BTagHeapsList);
 }
 
-inline static size_t getSizeWithBTMarkers(size_t size)
+inline static size_t getMappingSize(BTagHeapsList* node)
 {
-    return size + sizeof(BlockFooter) + sizeof(BlockHeader);
+    return sizeof(BTagHeapsList) + node->m_heap.m_bufferSize;
 }
 
-inline static size_t getSizeWithoutBTMarkers(size_t size)
+//-- Mappings bigger than the initial heap are rounded up to a quarter of their power of two,
+//-- so retained heaps serve requests of nearby sizes. Rest of the buffer is free BT space
+static size_t roundMappingSize(size_t size)
 {
-    return size - sizeof(BlockFooter) - sizeof(BlockHeader);
+    size_t mappingSize = (size + sizeOfPage - 1) & ~((size_t)sizeOfPage - 1);
+    if (mappingSize <= sizeOfPage * (1UL << initialOrderForBT))
+    {
+        return mappingSize;
+    }
+    size_t step = ((size_t)1 << (63 - __builtin_clzll(mappingSize - 1))) / 4;
+    return (mappingSize + step - 1) & ~(step - 1);
 }
 
-static void* allocInBT(size_t size, GlobalHeap* heap)
+static BTagHeapsList* mapBTHeap(size_t size, bool populate)
 {
-    BTagHeapsList* iterator = heap->m_btHeaps;
-    size_t         initialBTSize = sizeOfPage * (1UL << initialOrderForBT);
-    size_t         bufferSize = getSizeWithBTMarkers(size >= initialBTSize ? size : initialBTSize);
+    int   flags = MAP_ANONYMOUS | MAP_PRIVATE | (populate ? MAP_POPULATE : 0);
+    void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    return mapping != MAP_FAILED ? (BTagHeapsList*)(mapping) : NULL;
+}
 
-    while (iterator != NULL && iterator->m_next != NULL)
+//-- One span keeps list node and buffer of BT allocator right after it,
+//-- new heap goes to the head of the list and to its bin
+static BTagHeapsList* newBTHeap(size_t bufferSize, bool populate, GlobalHeap* heap)
+{
+    if (bufferSize > SIZE_MAX - sizeof(BTagHeapsList) - sizeOfPage)
+    {
+        return NULL;
+    }
+    size_t         sizeForBT = roundMappingSize(sizeof(BTagHeapsList) + bufferSize);
+    BTagHeapsList* node = populate ? NULL : takeRetainedBTHeap(sizeForBT, heap);
+    if (node != NULL)
+    {
+        sizeForBT = getMappingSize(node);
+        reclaimPurgedPages(node, heap);
+    }
+    else
     {
-        if ((size_t)(iterator->m_heap.m_freeSpace) >= getSizeWithBTMarkers(size))
+        node = hasSpace(heap) ? (BTagHeapsList*)spaceCommit(&heap->m_space, sizeForBT, SK_BTHeap, populate)
+                              : mapBTHeap(sizeForBT, populate);
+        if (node == NULL)
         {
-            return BTAlloc(size, &iterator->m_heap);
+            return NULL;
         }
-        iterator = iterator->m_next;
+        TRACE_EVENT(TE_HeapMap, sizeForBT);
+    }
+    node->m_prev = NULL;
+    node->m_next = heap->m_btHeaps;
+    node->m_binNext = NULL;
+    node->m_binPrev = NULL;
+    node->m_bin = -1;
+    node->m_pinned = false;
+    node->m_lastUse = heap->m_btEpoch;
+    setupBTagsAllocator(calculateAddresOfBuffer(node), sizeForBT - sizeof(BTagHeapsList), &node->m_heap);
+    if (hasSpace(heap))
+    {
+        BTUseAddressSpace(&node->m_heap, &heap->m_space);
+    }
+    if (heap->m_btHeaps != NULL)
+    {
+        heap->m_btHeaps->m_prev = node;
     }
-    if (iterator == NULL)
+    heap->m_btHeaps = node;
+    ++heap->m_btHeapsCount;
+    rebinBTHeap(node, heap);
+    return node;
+}
+
+//-- Takes the heap out of the list and bins, its pages stay committed
+static void detachBTHeap(BTagHeapsList* node, GlobalHeap* heap)
+{
+    if (heap->m_btRecentHeap == node)
     {
-        heap->m_btHeaps = mmapWrapperForBT(bufferSize);
-        iterator = heap->m_btHeaps;
+        heap->m_btRecentHeap = NULL;
+    }
+    unbinBTHeap(node, heap);
+    if (node->m_prev != NULL)
+    {
+        node->m_prev->m_next = node->m_next;
     }
     else
     {
-        iterator->m_next = mmapWrapperForBT(bufferSize);
-        iterator = iterator->m_next;
+        heap->m_btHeaps = node->m_next;
     }
+    if (node->m_next != NULL)
+    {
+        node->m_next->m_prev = node->m_prev;
+    }
+    --heap->m_btHeapsCount;
+}
+
+//-- Purged pages are counted as committed again, so the whole span can be decommitted or set up anew
+static void reclaimPurgedPages(BTagHeapsList* node, GlobalHeap* heap)
+{
+    if (hasSpace(heap) && node->m_heap.m_purgedSpace != 0)
+    {
+        spaceReclaim(&heap->m_space, node->m_heap.m_purgedSpace, false);
+    }
+    node->m_heap.m_purgedSpace = 0;
+}
 
-    iterator->m_next = NULL;
+//-- Bytes the heap gives back when it is decommitted
+static size_t residentSize(BTagHeapsList* node)
+{
+    return getMappingSize(node) - node->m_heap.m_purgedSpace;
+}
+
+static void decommitBTHeap(BTagHeapsList* node, GlobalHeap* heap)
+{
+    TRACE_EVENT(TE_HeapUnmap, getMappingSize(node));
+    reclaimPurgedPages(node, heap);
+    if (hasSpace(heap))
+    {
+        spaceDecommit(&heap->m_space, (void*)(node), getMappingSize(node));
+    }
+    else
+    {
+        munmap((void*)(node), getMappingSize(node));
+    }
+}
 
-    setupBTagsAllocator(calculateAddresOfBuffer(iterator), bufferSize, &iterator->m_heap);
+static void releaseBTHeap(BTagHeapsList* node, GlobalHeap* heap)
+{
+    detachBTHeap(node, heap);
+    decommitBTHeap(node, heap);
+}
 
-    return BTAlloc(size, &iterator->m_heap);
+//-- Retained heaps: empty heap released by free keeps its pages for the next large request,
+//-- so churn of large buffers doesn't commit and decommit every time. The least recently
+//-- retained heaps are given back when the bounds are hit, purge gives back ones idle for its age
+static void unlinkRetainedBTHeap(BTagHeapsList** link, GlobalHeap* heap)
+{
+    BTagHeapsList* node = *link;
+    *link = node->m_next;
+    --heap->m_btRetainedCount;
+    heap->m_btRetainedBytes -= getMappingSize(node);
 }
 
-static void freeInBT(void* address, GlobalHeap* heap)
+static void retainBTHeap(BTagHeapsList* node, GlobalHeap* heap)
 {
-    BTagHeapsList* iterator = heap->m_btHeaps;
-    if (iterator == NULL)
+    size_t mappingSize = getMappingSize(node);
+    detachBTHeap(node, heap);
+    if (mappingSize > retainedMaxMapping)
     {
+        decommitBTHeap(node, heap);
         return;
     }
-    size_t sizeForFree =
-        iterator->m_heap.m_bufferSize + sizeof(BTagHeapsList) + sizeof(BTagHeapsList*) + sizeof(BTagsHeap);
+    while (heap->m_btRetainedCount >= BT_RETAINED_HEAPS || heap->m_btRetainedBytes + mappingSize > retainedMaxBytes)
+    {
+        BTagHeapsList** last = &heap->m_btRetained;
+        while ((*last)->m_next != NULL)
+        {
+            last = &(*last)->m_next;
+        }
+        BTagHeapsList* evicted = *last;
+        unlinkRetainedBTHeap(last, heap);
+        decommitBTHeap(evicted, heap);
+    }
+    node->m_next = heap->m_btRetained;
+    node->m_lastUse = heap->m_btEpoch;
+    heap->m_btRetained = node;
+    ++heap->m_btRetainedCount;
+    heap->m_btRetainedBytes += mappingSize;
+}
 
-    BTagHeapsList* prevElem = iterator;
-    while (iterator != NULL)
+//-- Best fit, mapping up to twice the requested size is taken
+static BTagHeapsList* takeRetainedBTHeap(size_t mappingSize, GlobalHeap* heap)
+{
+    BTagHeapsList** best = NULL;
+    for (BTagHeapsList** link = &heap->m_btRetained; *link != NULL; link = &(*link)->m_next)
     {
-        if (address >= (void*)(iterator) && address <= ((void*)((byte*)(iterator) + iterator->m_heap.m_bufferSize)))
+        size_t size = getMappingSize(*link);
+        if (size >= mappingSize && size / 2 <= mappingSize && (best == NULL || size < getMappingSize(*best)))
         {
-            BTFree(address, &iterator->m_heap);
+            best = link;
+        }
+    }
+    if (best == NULL)
+    {
+        return NULL;
+    }
+    BTagHeapsList* node = *best;
+    unlinkRetainedBTHeap(best, heap);
+    return node;
+}
 
-            if (iterator != heap->m_btHeaps &&
-                getSizeWithoutBTMarkers(iterator->m_heap.m_bufferSize) == iterator->m_heap.m_freeSpace)
-            {
-                prevElem->m_next = iterator->m_next;
-                munmap((void*)(iterator), sizeForFree);
-            }
-            break;
+static size_t releaseRetainedBTHeaps(GlobalHeap* heap, unsigned age)
+{
+    size_t          released = 0;
+    BTagHeapsList** link = &heap->m_btRetained;
+    while (*link != NULL)
+    {
+        BTagHeapsList* node = *link;
+        if (heap->m_btEpoch - node->m_lastUse < age)
+        {
+            link = &node->m_next;
+            continue;
         }
-        prevElem = iterator;
-        iterator = iterator->m_next;
+        released += residentSize(node);
+        unlinkRetainedBTHeap(link, heap);
+        decommitBTHeap(node, heap);
     }
+    return released;
 }
 
-//-- Dump Allocator Data
-static void dumpCache(Cache* cache)
+//-- Heap selection index: bin of the heap is floor(log2(largest free block)),
+//-- heaps with nothing free are kept out of bins
+static int btBinOf(size_t blockSize)
 {
-    CSlabData* iterator = cache->m_freeSlabs;
-    while (iterator != NULL)
+    return 63 - __builtin_clzll(blockSize);
+}
+
+static void unbinBTHeap(BTagHeapsList* node, GlobalHeap* heap)
+{
+    if (node->m_bin < 0)
     {
-        printf("Free slab: %p\n", iterator);
-        printf("Free Blocks: %d\n", iterator->m_freeBlocksCount);
-        iterator = iterator->m_next;
+        return;
     }
-    iterator = cache->m_partlyFullSlabs;
-    while (iterator != NULL)
+    if (node->m_binPrev != NULL)
     {
-        printf("Partly full slab: %p\n", iterator);
-        printf("Free Blocks: %d\n", iterator->m_freeBlocksCount);
-        iterator = iterator->m_next;
+        node->m_binPrev->m_binNext = node->m_binNext;
     }
-    iterator = cache->m_fullSlabs;
-    while (iterator != NULL)
+    else
     {
-        printf("Full slab: %p\n", iterator);
-        printf("Free Blocks: %d\n", iterator->m_freeBlocksCount);
-        iterator = iterator->m_next;
+        heap->m_btBins[node->m_bin] = node->m_binNext;
+    }
+    if (node->m_binNext != NULL)
+    {
+        node->m_binNext->m_binPrev = node->m_binPrev;
+    }
+    if (heap->m_btBins[node->m_bin] == NULL)
+    {
+        heap->m_btBinsMap &= ~(1ULL << node->m_bin);
+    }
+    node->m_bin = -1;
+}
+
+//-- Has to be called every time largest free block of the heap could change
+static void rebinBTHeap(BTagHeapsList* node, GlobalHeap* heap)
+{
+    int bin = node->m_heap.m_largestFree != 0 ? btBinOf(node->m_heap.m_largestFree) : -1;
+    if (bin == node->m_bin)
+    {
+        return;
+    }
+    unbinBTHeap(node, heap);
+    if (bin < 0)
+    {
+        return;
+    }
+    node->m_bin = bin;
+    node->m_binPrev = NULL;
+    node->m_binNext = heap->m_btBins[bin];
+    if (node->m_binNext != NULL)
+    {
+        node->m_binNext->m_binPrev = node;
+    }
+    heap->m_btBins[bin] = node;
+    heap->m_btBinsMap |= 1ULL << bin;
+}
+
+//-- Any heap from a bin above the request bin fits, heaps from the request bin are checked one by one
+static BTagHeapsList* findBTHeapFor(size_t blockSize, GlobalHeap* heap)
+{
+    int      bin = btBinOf(blockSize);
+    uint64_t higherBins = bin < BT_HEAP_BINS - 1 ? heap->m_btBinsMap & (~0ULL << (bin + 1)) : 0;
+    if (higherBins != 0)
+    {
+        return heap->m_btBins[__builtin_ctzll(higherBins)];
+    }
+    for (BTagHeapsList* node = heap->m_btBins[bin]; node != NULL; node = node->m_binNext)
+    {
+        if (node->m_heap.m_largestFree >= blockSize)
+        {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+//-- Coalesces quick lists of every heap, returns false if there was nothing to coalesce
+static bool flushBTQuickLists(GlobalHeap* heap)
+{
+    bool flushed = false;
+    for (BTagHeapsList* iterator = heap->m_btHeaps; iterator != NULL; iterator = iterator->m_next)
+    {
+        if (iterator->m_heap.m_quickSpace != 0)
+        {
+            BTFlushQuickLists(&iterator->m_heap);
+            rebinBTHeap(iterator, heap);
+            flushed = true;
+        }
+    }
+    return flushed;
+}
+
+//-- Geometric growth: the last heap is extended in place while the range after it is free, it
+//-- at least doubles, so heaps stay few even for a lot of large objects
+static bool extendBTHeap(BTagHeapsList* node, size_t blockSize, GlobalHeap* heap)
+{
+    size_t mappingSize = getMappingSize(node);
+    size_t needed = (blockSize + sizeOfPage - 1) & ~((size_t)sizeOfPage - 1);
+    size_t growth = needed > mappingSize ? needed : mappingSize;
+    if (!hasSpace(heap) || mappingSize + growth > btMaxGrowSize ||
+        !spaceExtend(&heap->m_space, (void*)(node), mappingSize, mappingSize + growth))
+    {
+        return false;
+    }
+    TRACE_EVENT(TE_HeapExtend, growth);
+    BTExtend(&node->m_heap, growth);
+    return true;
+}
+
+//-- Size of the next new heap, doubles with count of heaps
+static size_t nextBTHeapSize(GlobalHeap* heap)
+{
+    size_t size = sizeOfPage * (1UL << initialOrderForBT);
+    for (int i = 0; i < heap->m_btHeapsCount && size < btMaxGrowSize; ++i)
+    {
+        size *= 2;
+    }
+    return size;
+}
+
+static void* allocInBT(size_t size, GlobalHeap* heap)
+{
+    size_t growSize = nextBTHeapSize(heap);
+    size_t blockSize = BTBlockSizeFor(size);
+    size_t bufferSize = BTBufferSizeFor(size);
+    if (blockSize == 0 || bufferSize == 0)
+    {
+        return NULL;
+    }
+
+    //-- Recently freed blocks of the same size are reused without touching the index
+    if (heap->m_btRecentHeap != NULL)
+    {
+        void* result = BTAllocFromQuickList(size, &heap->m_btRecentHeap->m_heap);
+        if (result != NULL)
+        {
+            heap->m_btRecentHeap->m_lastUse = heap->m_btEpoch;
+            return result;
+        }
+    }
+
+    BTagHeapsList* node = findBTHeapFor(blockSize, heap);
+    if (node == NULL && flushBTQuickLists(heap))
+    {
+        node = findBTHeapFor(blockSize, heap);
+    }
+    if (node == NULL && heap->m_btHeaps != NULL && extendBTHeap(heap->m_btHeaps, blockSize, heap))
+    {
+        node = heap->m_btHeaps;
+    }
+    if (node == NULL)
+    {
+        node = newBTHeap(bufferSize >= growSize ? bufferSize : growSize, false, heap);
+        if (node == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    void* result = BTAlloc(size, &node->m_heap);
+    node->m_lastUse = heap->m_btEpoch;
+    rebinBTHeap(node, heap);
+    return result;
+}
+
+//-- BT heap is found by the page map of the address space, or by the list without it
+static BTagHeapsList* findBTHeapOf(void* address, GlobalHeap* heap)
+{
+    SpanKind kind = SK_BTHeap;
+    if (hasSpace(heap))
+    {
+        BTagHeapsList* node = (BTagHeapsList*)spaceOwnerOf(&heap->m_space, address, &kind);
+        return kind == SK_BTHeap ? node : NULL;
+    }
+    for (BTagHeapsList* node = heap->m_btHeaps; node != NULL; node = node->m_next)
+    {
+        byte* buffer = (byte*)(node->m_heap.m_buffer);
+        if ((byte*)(address) >= buffer && (byte*)(address) < buffer + node->m_heap.m_bufferSize)
+        {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+static void freeInBT(void* address, GlobalHeap* heap)
+{
+    BTagHeapsList* node = findBTHeapOf(address, heap);
+    byte*          buffer = node != NULL ? (byte*)(node->m_heap.m_buffer) : NULL;
+    if (node == NULL || (byte*)(address) < buffer || (byte*)(address) >= buffer + node->m_heap.m_bufferSize)
+    {
+        return;
+    }
+
+    BTFree(address, &node->m_heap);
+    node->m_lastUse = heap->m_btEpoch;
+    if (node->m_heap.m_quickSpace != 0)
+    {
+        heap->m_btRecentHeap = node;
+    }
+
+    //-- The oldest heap and reserved heaps stay mapped, with purge thread running
+    //-- empty heaps wait for it
+    if (node->m_next != NULL && !node->m_pinned && !heap->m_purgeRunning && BTIsEmpty(&node->m_heap))
+    {
+        retainBTHeap(node, heap);
+    }
+    else
+    {
+        rebinBTHeap(node, heap);
+    }
+}
+
+//-- Dump Allocator Data
+static void dumpCache(Cache* cache)
+{
+    static const char* stateNames[] = {"Free", "Partly full", "Full"};
+    for (CSlabData* iterator = atomic_load(&cache->m_allSlabs); iterator != NULL; iterator = iterator->m_allNext)
+    {
+        printf("%s slab: %p\n", stateNames[atomic_load(&iterator->m_state)], iterator);
+        printf("Free Blocks: %d\n", slabFreeBlocks(iterator));
     }
 }
 
@@ -225,10 +1051,96 @@ static void dumpBTagsAllocator(BTagHeapsList* heap)
     printf("Buffer size: %ld\n", heap->m_heap.m_bufferSize);
 }
 
+//-- JSON dump: slabs are read without locks, so counters of a busy cache are approximate
+#define DUMP_OCCUPANCY_BUCKETS 10
+
+static double fragmentationOf(size_t largestFree, size_t freeBytes)
+{
+    return freeBytes != 0 ? 1.0 - (double)(largestFree) / (double)(freeBytes) : 0.0;
+}
+
+static size_t dumpCacheJson(FILE* file, Cache* cache, bool last)
+{
+    size_t histogram[DUMP_OCCUPANCY_BUCKETS] = {0};
+    size_t slabs = 0, closedSlabs = 0, releasedSlabs = 0, inUse = 0;
+    for (CSlabData* iterator = atomic_load(&cache->m_allSlabs); iterator != NULL; iterator = iterator->m_allNext)
+    {
+        ++slabs;
+        if (atomic_load(&iterator->m_state) == SS_Free)
+        {
+            ++closedSlabs;
+            releasedSlabs += iterator->m_bodyReleased ? 1 : 0;
+            continue;
+        }
+        size_t objects = slabObjectsInUse(cache, iterator);
+        size_t bucket = objects * DUMP_OCCUPANCY_BUCKETS / slabGeometry(cache, iterator)->m_slabObjects;
+        ++histogram[bucket < DUMP_OCCUPANCY_BUCKETS ? bucket : DUMP_OCCUPANCY_BUCKETS - 1];
+        inUse += objects;
+    }
+    //-- Slabs of other sizes may still be alive, current geometry is what new slabs get
+    const SlabGeometry* geometry = cacheCurrentGeometry(cache);
+    fprintf(file,
+            "    {\"object_size\": %zu, \"slab_size\": %d, \"slab_objects\": %zu, \"slabs\": %zu, "
+            "\"closed_slabs\": %zu, \"released_slabs\": %zu, \"objects_in_use\": %zu, \"occupancy_histogram\": [",
+            cache->m_objectSize, geometry->m_slabSize, geometry->m_slabObjects, slabs, closedSlabs, releasedSlabs,
+            inUse);
+    for (int i = 0; i < DUMP_OCCUPANCY_BUCKETS; ++i)
+    {
+        fprintf(file, i == 0 ? "%zu" : ", %zu", histogram[i]);
+    }
+    fprintf(file, "]}%s\n", last ? "" : ",");
+    return inUse * cache->m_objectSize;
+}
+
+bool eh_dump_json(const char* path)
+{
+    FILE* file = fopen(path, "w");
+    if (file == NULL)
+    {
+        return false;
+    }
+    GlobalHeap* heap = heapSingleton();
+    ensureHeap(heap);
+    fprintf(file, "{\n  \"caches\": [\n");
+    size_t inUse = dumpCacheJson(file, &heap->m_cacheSmall, false);
+    inUse += dumpCacheJson(file, &heap->m_cacheMedium, false);
+    inUse += dumpCacheJson(file, &heap->m_cacheBig, true);
+
+    //-- BT heaps are walked block by block under their lock
+    fprintf(file, "  ],\n  \"bt_heaps\": [\n");
+    size_t totalFree = 0, largestFree = 0;
+    traceLock(&heap->m_btLock);
+    for (BTagHeapsList* iterator = heap->m_btHeaps; iterator != NULL; iterator = iterator->m_next)
+    {
+        BTagsStats stats;
+        BTCollectStats(&iterator->m_heap, &stats);
+        fprintf(file,
+                "    {\"buffer_size\": %zu, \"used_blocks\": %zu, \"used_bytes\": %zu, \"free_blocks\": %zu, "
+                "\"free_bytes\": %zu, \"quick_blocks\": %zu, \"quick_bytes\": %zu, \"largest_free\": %zu, "
+                "\"pinned\": %s, \"fragmentation\": %.4f}%s\n",
+                iterator->m_heap.m_bufferSize, stats.m_usedBlocks, stats.m_usedBytes, stats.m_freeBlocks,
+                stats.m_freeBytes, stats.m_quickBlocks, stats.m_quickBytes, stats.m_largestFree,
+                iterator->m_pinned ? "true" : "false", fragmentationOf(stats.m_largestFree, stats.m_freeBytes),
+                iterator->m_next != NULL ? "," : "");
+        inUse += stats.m_usedBytes;
+        totalFree += stats.m_freeBytes;
+        largestFree = stats.m_largestFree > largestFree ? stats.m_largestFree : largestFree;
+    }
+    size_t retainedBytes = heap->m_btRetainedBytes;
+    pthread_mutex_unlock(&heap->m_btLock);
+
+    fprintf(file,
+            "  ],\n  \"mapped_bytes\": %zu,\n  \"in_use_bytes\": %zu,\n  \"bt_free_bytes\": %zu,\n"
+            "  \"bt_largest_free\": %zu,\n  \"bt_fragmentation\": %.4f,\n  \"bt_retained_bytes\": %zu\n}\n",
+            spaceCommitted(&heap->m_space), inUse, totalFree, largestFree, fragmentationOf(largestFree, totalFree),
+            retainedBytes);
+    return fclose(file) == 0;
+}
+
 void dumpHeap()
 {
     GlobalHeap* heap = heapSingleton();
-    pthread_mutex_lock(&heap->m_mutex);
+    traceLock(&heap->m_btLock);
     printf("-----Small cache------\n");
     dumpCache(&heap->m_cacheSmall);
     printf("------Medium cache------\n");
@@ -242,5 +1154,5 @@ void dumpHeap()
         dumpBTagsAllocator(iterator);
         iterator = iterator->m_next;
     }
-    pthread_mutex_unlock(&heap->m_mutex);
+    pthread_mutex_unlock(&heap->m_btLock);
 }
\ No newline at end of file
@@ -0,0 +1,149 @@
+//-- Replacements of global operator new and delete, link build/eh_new.o into the binary to use them
+#include <eh_malloc.h>
+
+#include <cstddef>
+#include <new>
+
+namespace
+{
+//-- Calls new handler until allocation succeeds, as the standard operator new does
+void* allocateOrThrow(std::size_t size, std::size_t alignment)
+{
+    if (size == 0)
+    {
+        size = 1;
+    }
+    for (;;)
+    {
+        void* memory = eh_malloc_aligned(size, alignment);
+        if (memory != nullptr)
+        {
+            return memory;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+void* allocateOrNull(std::size_t size, std::size_t alignment) noexcept
+{
+    try
+    {
+        return allocateOrThrow(size, alignment);
+    }
+    catch (...)
+    {
+        return nullptr;
+    }
+}
+
+//-- Sized delete checks the size against the owner, slab blocks are freed after one page map lookup
+void deallocate(void* pointer, std::size_t size) noexcept
+{
+    eh_free_sized(pointer, size != 0 ? size : 1);
+}
+} // namespace
+
+void* operator new(std::size_t size)
+{
+    return allocateOrThrow(size, EH_MALLOC_ALIGNMENT);
+}
+
+void* operator new[](std::size_t size)
+{
+    return allocateOrThrow(size, EH_MALLOC_ALIGNMENT);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    return allocateOrNull(size, EH_MALLOC_ALIGNMENT);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+    return allocateOrNull(size, EH_MALLOC_ALIGNMENT);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+    return allocateOrThrow(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment)
+{
+    return allocateOrThrow(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return allocateOrNull(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return allocateOrNull(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* pointer) noexcept
+{
+    eh_free(pointer);
+}
+
+void operator delete[](void* pointer) noexcept
+{
+    eh_free(pointer);
+}
+
+void operator delete(void* pointer, const std::nothrow_t&) noexcept
+{
+    eh_free(pointer);
+}
+
+void operator delete[](void* pointer, const std::nothrow_t&) noexcept
+{
+    eh_free(pointer);
+}
+
+void operator delete(void* pointer, std::size_t size) noexcept
+{
+    deallocate(pointer, size);
+}
+
+void operator delete[](void* pointer, std::size_t size) noexcept
+{
+    deallocate(pointer, size);
+}
+
+void operator delete(void* pointer, std::align_val_t alignment) noexcept
+{
+    eh_free_aligned(pointer, static_cast<std::size_t>(alignment));
+}
+
+void operator delete[](void* pointer, std::align_val_t alignment) noexcept
+{
+    eh_free_aligned(pointer, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* pointer, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    eh_free_aligned(pointer, static_cast<std::size_t>(alignment));
+}
+
+void operator delete[](void* pointer, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    eh_free_aligned(pointer, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* pointer, std::size_t size, std::align_val_t alignment) noexcept
+{
+    eh_free_aligned(pointer, static_cast<std::size_t>(alignment));
+}
+
+void operator delete[](void* pointer, std::size_t size, std::align_val_t alignment) noexcept
+{
+    eh_free_aligned(pointer, static_cast<std::size_t>(alignment));
+}
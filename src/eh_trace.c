@@ -0,0 +1,104 @@
+#include <eh_malloc.h>
+#include <eh_trace.h>
+
+#ifdef EH_TRACE
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+typedef struct STraceEvent
+{
+    uint64_t m_tsc;
+    uint64_t m_arg;
+    uint32_t m_type;
+} TraceEvent;
+
+//-- Ring of one thread, written only by its owner. Rings are mapped directly since the
+//-- allocator itself is traced, and never unmapped, so events of exited threads are dumped too
+typedef struct STraceRing
+{
+    struct STraceRing* m_next;
+    long               m_tid;
+    _Atomic(uint64_t)  m_head; /* count of events ever written */
+    TraceEvent         m_events[EH_TRACE_EVENTS];
+} TraceRing;
+
+static _Atomic(TraceRing*) traceRings = NULL;
+static __thread TraceRing* threadRing = NULL;
+
+static const char* eventNames[TE_Count] = {"lock_wait", "slab_create", "slab_release", "slab_destroy",
+                                           "heap_map",  "heap_unmap",  "coalesce",     "heap_extend"};
+
+static TraceRing* createRing()
+{
+    void* memory = mmap(NULL, sizeof(TraceRing), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        return NULL;
+    }
+    TraceRing* ring = (TraceRing*)memory;
+    ring->m_tid = syscall(SYS_gettid);
+    atomic_init(&ring->m_head, 0);
+    ring->m_next = atomic_load(&traceRings);
+    while (!atomic_compare_exchange_weak(&traceRings, &ring->m_next, ring))
+    {
+    }
+    return ring;
+}
+
+void traceEvent(TraceEventType type, uint64_t arg)
+{
+    TraceRing* ring = threadRing;
+    if (ring == NULL)
+    {
+        ring = threadRing = createRing();
+        if (ring == NULL)
+        {
+            return;
+        }
+    }
+    uint64_t    head = atomic_load_explicit(&ring->m_head, memory_order_relaxed);
+    TraceEvent* event = &ring->m_events[head % EH_TRACE_EVENTS];
+    event->m_tsc = __rdtsc();
+    event->m_arg = arg;
+    event->m_type = (uint32_t)(type);
+    atomic_store_explicit(&ring->m_head, head + 1, memory_order_release);
+}
+
+//-- Events being overwritten while the dump runs may come out torn, the dump is for offline
+//-- analysis and doesn't stop writers
+bool eh_trace_dump(const char* path)
+{
+    FILE* file = fopen(path, "w");
+    if (file == NULL)
+    {
+        return false;
+    }
+    fprintf(file, "# tid tsc event arg\n");
+    for (TraceRing* ring = atomic_load(&traceRings); ring != NULL; ring = ring->m_next)
+    {
+        uint64_t head = atomic_load_explicit(&ring->m_head, memory_order_acquire);
+        uint64_t first = head > EH_TRACE_EVENTS ? head - EH_TRACE_EVENTS : 0;
+        for (uint64_t i = first; i < head; ++i)
+        {
+            TraceEvent* event = &ring->m_events[i % EH_TRACE_EVENTS];
+            if (event->m_type < TE_Count)
+            {
+                fprintf(file, "%ld %lu %s %lu\n", ring->m_tid, event->m_tsc, eventNames[event->m_type], event->m_arg);
+            }
+        }
+    }
+    return fclose(file) == 0;
+}
+
+#else
+
+bool eh_trace_dump(const char* path)
+{
+    return false;
+}
+
+#endif
@@ -0,0 +1,294 @@
+#define _GNU_SOURCE
+#include <persistent_heap.h>
+#include <eh_trace.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+typedef unsigned char byte;
+
+static const size_t persistentPageSize = 4096;
+static const size_t persistentSlabSizes[PH_CACHES] = {8, 16, 32, 64, 512, 4096};
+//-- Minimal buffer of a BT heap, bigger blocks get a heap of their own size
+static const size_t persistentBTHeapSize = (size_t)1 << 20;
+
+static size_t alignUpPage(size_t value)
+{
+    return (value + persistentPageSize - 1) & ~(persistentPageSize - 1);
+}
+
+//-- Locks are process shared in shared memory, in a file they are private and initialized on
+//-- every open since the previous owner may have died holding them
+static void initHeapLocks(PersistentHeap* heap)
+{
+    spaceInitLock(&heap->m_space, heap->m_processShared);
+    for (int i = 0; i < PH_CACHES; ++i)
+    {
+        cacheInitLock(&heap->m_caches[i], heap->m_processShared);
+    }
+    spaceInitMutex(&heap->m_lock, heap->m_processShared);
+}
+
+//-- Page map takes 8 bytes per page of the range after it
+static size_t pageMapPages(size_t size)
+{
+    return (size - alignUpPage(sizeof(PersistentHeap))) / (persistentPageSize + sizeof(uint64_t));
+}
+
+//-- Lays out zero filled memory, header and page map have to be writable
+static bool formatHeap(PersistentHeap* heap, size_t size, bool processShared, bool fileBacked)
+{
+    size_t mapOffset = alignUpPage(sizeof(PersistentHeap));
+    if (size <= mapOffset + 2 * persistentPageSize)
+    {
+        return false;
+    }
+    size_t pages = pageMapPages(size);
+    size_t mapSize = alignUpPage(pages * sizeof(uint64_t));
+    size_t rangeSize = size - mapOffset - mapSize;
+    rangeSize = rangeSize < pages * persistentPageSize ? rangeSize : pages * persistentPageSize;
+    byte* map = (byte*)(heap) + mapOffset;
+    spaceInitAt(&heap->m_space, map + mapSize, rangeSize, map, fileBacked);
+
+    for (int i = 0; i < PH_CACHES; ++i)
+    {
+        cacheSetupWithLayout(&heap->m_caches[i], persistentSlabSizes[i], SL_Bitmap);
+        cacheUseAddressSpace(&heap->m_caches[i], &heap->m_space);
+    }
+    heap->m_btHeaps = NULL;
+    heap->m_root = NULL;
+    heap->m_base = heap;
+    heap->m_size = size;
+    heap->m_version = PH_VERSION;
+    heap->m_layoutSize = sizeof(PersistentHeap);
+    heap->m_processShared = processShared;
+    initHeapLocks(heap);
+    atomic_thread_fence(memory_order_release);
+    heap->m_magic = PH_MAGIC;
+    return true;
+}
+
+static bool isHeapOf(PersistentHeap* heap, size_t size, bool processShared)
+{
+    return heap->m_magic == PH_MAGIC && heap->m_version == PH_VERSION && heap->m_layoutSize == sizeof(PersistentHeap) &&
+           heap->m_base == heap && heap->m_size == size && heap->m_processShared == processShared;
+}
+
+//-- Formats empty file with given size, or maps existing heap with its own size
+static PersistentHeap* mapHeap(int fd, void* base, size_t size, bool processShared)
+{
+    if (base == NULL || (uintptr_t)(base) % persistentPageSize != 0)
+    {
+        return NULL;
+    }
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0)
+    {
+        return NULL;
+    }
+    bool fresh = fileStat.st_size == 0;
+    if (fresh && (size == 0 || ftruncate(fd, (off_t)(size)) != 0))
+    {
+        return NULL;
+    }
+    size = fresh ? size : (size_t)(fileStat.st_size);
+
+    void* mapping = mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        return NULL;
+    }
+    //-- Old kernels take the address only as a hint
+    PersistentHeap* heap = (PersistentHeap*)(mapping);
+    if (mapping != base || !(fresh ? formatHeap(heap, size, processShared, true) : isHeapOf(heap, size, processShared)))
+    {
+        munmap(mapping, size);
+        return NULL;
+    }
+    //-- Other processes keep using locks of shared heap
+    if (!fresh && !processShared)
+    {
+        initHeapLocks(heap);
+    }
+    return heap;
+}
+
+PersistentHeap* eh_persistent_open(const char* path, void* base, size_t size)
+{
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    PersistentHeap* heap = mapHeap(fd, base, size, false);
+    close(fd);
+    return heap;
+}
+
+PersistentHeap* eh_shared_open(int fd, void* base, size_t size)
+{
+    return mapHeap(fd, base, size, true);
+}
+
+static PersistentBTHeap* newPersistentBTHeap(PersistentHeap* heap, size_t size)
+{
+    size_t bufferSize = BTBufferSizeFor(size);
+    if (bufferSize == 0 || bufferSize > heap->m_size)
+    {
+        return NULL;
+    }
+    bufferSize = bufferSize > persistentBTHeapSize ? bufferSize : persistentBTHeapSize;
+    size_t            mappingSize = alignUpPage(sizeof(PersistentBTHeap) + bufferSize);
+    PersistentBTHeap* node = (PersistentBTHeap*)spaceCommit(&heap->m_space, mappingSize, SK_BTHeap, false);
+    if (node == NULL)
+    {
+        return NULL;
+    }
+    TRACE_EVENT(TE_HeapMap, mappingSize);
+    setupBTagsAllocator(node + 1, mappingSize - sizeof(PersistentBTHeap), &node->m_heap);
+    node->m_mappingSize = mappingSize;
+    node->m_next = heap->m_btHeaps;
+    heap->m_btHeaps = node;
+    return node;
+}
+
+static void releasePersistentBTHeap(PersistentHeap* heap, PersistentBTHeap* node)
+{
+    PersistentBTHeap** link = &heap->m_btHeaps;
+    while (*link != node)
+    {
+        link = &(*link)->m_next;
+    }
+    *link = node->m_next;
+    TRACE_EVENT(TE_HeapUnmap, node->m_mappingSize);
+    spaceDecommit(&heap->m_space, node, node->m_mappingSize);
+}
+
+static void* allocInPersistentBT(PersistentHeap* heap, size_t size)
+{
+    size_t blockSize = BTBlockSizeFor(size);
+    if (blockSize == 0)
+    {
+        return NULL;
+    }
+    for (PersistentBTHeap* node = heap->m_btHeaps; node != NULL; node = node->m_next)
+    {
+        if (node->m_heap.m_largestFree >= blockSize || node->m_heap.m_quickSpace != 0)
+        {
+            void* result = BTAlloc(size, &node->m_heap);
+            if (result != NULL)
+            {
+                return result;
+            }
+        }
+    }
+    PersistentBTHeap* node = newPersistentBTHeap(heap, size);
+    return node != NULL ? BTAlloc(size, &node->m_heap) : NULL;
+}
+
+void* eh_persistent_malloc(PersistentHeap* heap, size_t size)
+{
+    if (size == 0)
+    {
+        return NULL;
+    }
+    for (int i = 0; i < PH_CACHES; ++i)
+    {
+        if (size <= persistentSlabSizes[i])
+        {
+            return cacheAlloc(&heap->m_caches[i]);
+        }
+    }
+    traceLock(&heap->m_lock);
+    void* result = allocInPersistentBT(heap, size);
+    pthread_mutex_unlock(&heap->m_lock);
+    return result;
+}
+
+void eh_persistent_free(PersistentHeap* heap, void* address)
+{
+    SpanKind kind = SK_None;
+    void*    owner = address != NULL ? spaceOwnerOf(&heap->m_space, address, &kind) : NULL;
+    if (kind == SK_Slab)
+    {
+        cacheFreeToSlab(((CSlabData*)(owner))->m_cache, (CSlabData*)(owner), address);
+        return;
+    }
+    if (kind != SK_BTHeap)
+    {
+        return;
+    }
+    PersistentBTHeap* node = (PersistentBTHeap*)(owner);
+    traceLock(&heap->m_lock);
+    BTFree(address, &node->m_heap);
+    if (BTIsEmpty(&node->m_heap))
+    {
+        releasePersistentBTHeap(heap, node);
+    }
+    pthread_mutex_unlock(&heap->m_lock);
+}
+
+void eh_persistent_set_root(PersistentHeap* heap, void* root)
+{
+    heap->m_root = root;
+}
+
+void* eh_persistent_root(PersistentHeap* heap)
+{
+    return heap->m_root;
+}
+
+//-- Shared memory has no file to write to, msync is just a no-op there
+bool eh_persistent_sync(PersistentHeap* heap)
+{
+    return msync(heap, heap->m_size, MS_SYNC) == 0;
+}
+
+void eh_persistent_close(PersistentHeap* heap)
+{
+    size_t size = heap->m_size;
+    eh_persistent_sync(heap);
+    munmap(heap, size);
+}
+
+//-- Compact heap: private anonymous memory reserved at any address, only the header and the
+//-- page map are writable up front, the space commits the rest
+PersistentHeap* eh_compact_create()
+{
+    size_t size = (size_t)1 << 32;
+    void*  mapping = mmap(NULL, size, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED)
+    {
+        return NULL;
+    }
+    PersistentHeap* heap = (PersistentHeap*)(mapping);
+    size_t          mapSize = alignUpPage(pageMapPages(size) * sizeof(uint64_t));
+    size_t          headerSize = alignUpPage(sizeof(PersistentHeap)) + mapSize;
+    if (mprotect(mapping, headerSize, PROT_READ | PROT_WRITE) != 0 || !formatHeap(heap, size, false, false))
+    {
+        munmap(mapping, size);
+        return NULL;
+    }
+    return heap;
+}
+
+CompactHandle eh_compact_malloc(PersistentHeap* heap, size_t size)
+{
+    return eh_compact_handle(heap, eh_persistent_malloc(heap, size));
+}
+
+void eh_compact_free(PersistentHeap* heap, CompactHandle handle)
+{
+    eh_persistent_free(heap, eh_compact_ptr(heap, handle));
+}
+
+void eh_compact_destroy(PersistentHeap* heap)
+{
+    munmap(heap, heap->m_size);
+}
@@ -1,36 +1,71 @@
 #include <slab_allocator.h>
+#include <eh_trace.h>
 #define _GNU_SOURCE
 #include <sys/mman.h>
 #undef _GNU_SOURCE
+#include <nmmintrin.h>
 #include <stdio.h>
 
 typedef unsigned char byte;
 
-const int _sizeOfPage = 4096;
-const int maxPossibleOrder = 10;
-const int minObjectCount = 100;
+const int    _sizeOfPage = 4096;
+const int    maxPossibleOrder = 10;
+const int    minObjectCount = 100;
+const size_t cacheLineSize = 64;
+//-- Slabs grow up to huge page size, one order after this many slab creations in a row
+const int maxGrowthOrder = 9;
+const int slabGrowthStreak = 4;
+//-- Slab pointers use 48 bits, upper bits of the stack head keep ABA tag
+const int      slabTagShift = 48;
+const uint64_t slabPointerMask = (1ULL << 48) - 1;
 
 //-- FD for funcs used by cache API
-int          countFullSlabMinimumSize(int sizeObject);
-int          countPossibleCountOfObjectsInSlab(int orderToPageSize, int objectSize);
-static void* getFreeBlockFromFreeSlab(Cache* cache);
-static void* getFreeBlockFromPartlyFullSlab(Cache* cache);
-static void  initNewFreeSlab(Cache* cache);
-static void  moveSlab(Cache* cache, CSlabData* pos, SlabState whereToMove, SlabState fromMoved);
-static void  letTheSlabGo(Cache* cache, SlabState stateToFree);
-static int   countSlabs(Cache* cache, SlabState stateToCount);
+int               countFullSlabMinimumSize(int sizeObject);
+int               countPossibleCountOfObjectsInSlab(int orderToPageSize, int objectSize);
+static void*      getFreeBlockFromFreeSlab(Cache* cache);
+static void*      getFreeBlockFromPartlyFullSlab(Cache* cache);
+static CSlabData* initNewFreeSlab(Cache* cache, bool populate);
+static void*      allocSlab(Cache* cache, const SlabGeometry* geometry, bool populate);
+static void       freeSlab(Cache* cache, void* slab);
+static void       shrinkLocked(Cache* cache, unsigned age);
+static void       destructObjects(Cache* cache, CSlabData* slab);
+static size_t     alignUp(size_t value, size_t align);
+static size_t     slabHeaderPagesSize(Cache* cache, CSlabData* slab);
 static CSlabData* getIteratorByAddress(void* address, Cache* cache);
+static void       setupGeometries(Cache* cache, int baseOrder, size_t align);
+static void*      claimBlock(Cache* cache, CSlabData* slab);
+static bool       putBlockToSlab(Cache* cache, CSlabData* slab, void* ptr);
+static void       pushSlab(_Atomic(uint64_t)* stack, CSlabData* slab);
+static CSlabData* popSlab(_Atomic(uint64_t)* stack);
 
 #define trace printf("File: %s --- Function: %s --- Line: %d\n", __FILE__, __FUNCTION__, __LINE__);
 
 //-- Cache API goes here
 //-- Set up cache for forward usages
 void cacheSetup(Cache* cache, size_t object_size)
+{
+    cacheSetupWithLayout(cache, object_size, SL_Inline);
+}
+
+//-- Set up cache with explicit slab layout
+void cacheSetupWithLayout(Cache* cache, size_t object_size, SlabLayout layout)
 {
     cache->m_objectSize = object_size;
-    cache->m_freeSlabs = NULL;
-    cache->m_fullSlabs = NULL;
-    cache->m_partlyFullSlabs = NULL;
+    cache->m_layout = layout;
+    cache->m_objectAlign = 1;
+    atomic_init(&cache->m_freeSlabs, 0);
+    atomic_init(&cache->m_partlyFullSlabs, 0);
+    atomic_init(&cache->m_allSlabs, NULL);
+    atomic_init(&cache->m_emptySlabs, 0);
+    atomic_init(&cache->m_slabsCount, 0);
+    pthread_mutex_init(&cache->m_lock, NULL);
+    cache->m_reservedSlabs = 0;
+    cache->m_space = NULL;
+    atomic_init(&cache->m_autoShrink, true);
+    atomic_init(&cache->m_epoch, 0);
+    cache->m_ctor = NULL;
+    cache->m_dtor = NULL;
+    cache->m_callbackArg = NULL;
 
     int minimumSlabSizeAcceptable = countFullSlabMinimumSize(object_size);
     for (int i = 0; i <= maxPossibleOrder; ++i)
@@ -38,131 +73,278 @@ void cacheSetup(Cache* cache, size_t object_size)
         int currentOrderToPageSize = (1UL << i) * _sizeOfPage;
         if ((minimumSlabSizeAcceptable <= currentOrderToPageSize) || i == maxPossibleOrder)
         {
-            cache->m_slabOrder = i;
-            cache->m_slabSize = currentOrderToPageSize;
-            cache->m_slabObjects =
-                countPossibleCountOfObjectsInSlab(currentOrderToPageSize, cache->m_objectSize);
+            size_t lowestBit = object_size & (~object_size + 1);
+            setupGeometries(cache, i, lowestBit < cacheLineSize ? lowestBit : cacheLineSize);
             return;
         }
     }
 }
 
-//-- Allocates memory (return >= object_size) from cache
-void* cacheAlloc(Cache* cache)
+//-- Set up object cache, size is rounded up to alignment so every slot is aligned
+bool cacheSetupObjects(Cache* cache, size_t objectSize, size_t align, CacheObjectCallback ctor,
+                       CacheObjectCallback dtor, void* arg)
 {
-    if (cache->m_partlyFullSlabs != NULL)
+    if (align == 0 || (align & (align - 1)) != 0 || align > (size_t)(_sizeOfPage) || objectSize == 0 ||
+        objectSize > ((size_t)(1) << maxPossibleOrder) * _sizeOfPage)
     {
-        return getFreeBlockFromPartlyFullSlab(cache);
+        return false;
     }
-    else if (cache->m_freeSlabs != NULL)
+    objectSize = alignUp(objectSize, align);
+    cacheSetupWithLayout(cache, objectSize, SL_Bitmap);
+    if (align > cache->m_objectAlign)
     {
-        //-- take first free slab, return first block, move slab to m_partlyFullSlabs
-        return getFreeBlockFromFreeSlab(cache);
+        setupGeometries(cache, cache->m_geometries[0].m_slabOrder, align);
     }
-    else
+    atomic_store(&cache->m_autoShrink, false);
+    cache->m_ctor = ctor;
+    cache->m_dtor = dtor;
+    cache->m_callbackArg = arg;
+    if (cache->m_geometries[0].m_slabObjects == 0)
     {
-        //-- allocate new free slab, take one pice and move new allocated slab to m_partlyFullSlabs
-        initNewFreeSlab(cache);
-        return getFreeBlockFromFreeSlab(cache);
+        pthread_mutex_destroy(&cache->m_lock);
+        return false;
     }
+    return true;
+}
+
+//-- Commit slabs inside the address space instead of mapping them one by one
+void cacheUseAddressSpace(Cache* cache, AddressSpace* space)
+{
+    cache->m_space = space;
+}
+
+void cacheInitLock(Cache* cache, bool processShared)
+{
+    spaceInitMutex(&cache->m_lock, processShared);
+}
+
+//-- Allocates memory (return >= object_size) from cache
+void* cacheAlloc(Cache* cache)
+{
+    void* block = getFreeBlockFromPartlyFullSlab(cache);
+    if (block != NULL)
+    {
+        return block;
+    }
+    //-- take free slab (or allocate new one), return first block, move slab to m_partlyFullSlabs
+    return getFreeBlockFromFreeSlab(cache);
 }
 
 //-- Returns memory back in cache
 void cacheFree(Cache* cache, void* ptr)
 {
     CSlabData* slab = getIteratorByAddress(ptr, cache);
+    if (slab != NULL)
+    {
+        cacheFreeToSlab(cache, slab, ptr);
+    }
+}
 
-    ++slab->m_freeBlocksCount;
-
-    if (slab->m_freeBlocksCount == 1)
+void cacheFreeToSlab(Cache* cache, CSlabData* slab, void* ptr)
+{
+    if (!putBlockToSlab(cache, slab, ptr))
     {
-        slab->m_state = SS_PartlyFull;
-        moveSlab(cache, slab, SS_PartlyFull, SS_Full);
+        return;
     }
 
-    if ((size_t)slab->m_freeBlocksCount == cache->m_slabObjects)
+    int freeBlocks = atomic_fetch_add(&slab->m_freeBlocksCount, 1) + 1;
+
+    //-- Slab was full and nobody keeps it in partly full stack
+    if (freeBlocks == 1)
     {
-        slab->m_state = SS_Free;
-        moveSlab(cache, slab, SS_Free, SS_PartlyFull);
+        bool listed = false;
+        if (atomic_compare_exchange_strong(&slab->m_listed, &listed, true))
+        {
+            atomic_store(&slab->m_state, SS_PartlyFull);
+            pushSlab(&cache->m_partlyFullSlabs, slab);
+        }
     }
 
+    if ((size_t)freeBlocks != slabGeometry(cache, slab)->m_slabObjects)
+    {
+        return;
+    }
+    atomic_store_explicit(&slab->m_emptyEpoch, atomic_load_explicit(&cache->m_epoch, memory_order_relaxed),
+                          memory_order_relaxed);
     //-- If we collected more than one free slab - automatically clean
-    //-- to avoid too much memory wasting
-    if (countSlabs(cache, SS_Free) > 1)
+    //-- to avoid too much memory wasting, busy lock means somebody is already at it
+    if (atomic_fetch_add(&cache->m_emptySlabs, 1) + 1 > 1 &&
+        atomic_load_explicit(&cache->m_autoShrink, memory_order_relaxed) &&
+        tryLockMutex(&cache->m_lock))
     {
-        cacheShrink(cache);
+        shrinkLocked(cache, 0);
+        pthread_mutex_unlock(&cache->m_lock);
     }
 }
 
 //-- Return all memory from cache to system
 void cacheRelease(Cache* cache)
 {
-    letTheSlabGo(cache, SS_Free);
-    letTheSlabGo(cache, SS_Full);
-    letTheSlabGo(cache, SS_PartlyFull);
+    traceLock(&cache->m_lock);
+    CSlabData* iterator = atomic_load(&cache->m_allSlabs);
+    while (iterator != NULL)
+    {
+        CSlabData* next = iterator->m_allNext;
+        destructObjects(cache, iterator);
+        if (iterator->m_bodyReleased && cache->m_space != NULL)
+        {
+            size_t bodySize =
+                (size_t)(slabGeometry(cache, iterator)->m_slabSize) - slabHeaderPagesSize(cache, iterator);
+            spaceReclaim(cache->m_space, bodySize, false);
+        }
+        freeSlab(cache, (void*)(iterator));
+        iterator = next;
+    }
+    atomic_store(&cache->m_allSlabs, NULL);
+    atomic_store(&cache->m_freeSlabs, 0);
+    atomic_store(&cache->m_partlyFullSlabs, 0);
+    atomic_store(&cache->m_emptySlabs, 0);
+    atomic_store(&cache->m_slabsCount, 0);
+    cache->m_reservedSlabs = 0;
+    pthread_mutex_unlock(&cache->m_lock);
 }
 
-//-- Function returns all free slabs to system
+//-- Function returns all free slabs to system, reserved slabs stay
 void cacheShrink(Cache* cache)
 {
-    letTheSlabGo(cache, SS_Free);
+    traceLock(&cache->m_lock);
+    shrinkLocked(cache, 0);
+    pthread_mutex_unlock(&cache->m_lock);
 }
 
-bool hasAddressInSlab(void* address, CSlabData* iterator, int slabSize)
+void cachePurge(Cache* cache, unsigned age)
 {
-    if (iterator == NULL)
-    {
-        return false;
-    }
-    while (iterator != NULL)
+    traceLock(&cache->m_lock);
+    atomic_fetch_add(&cache->m_epoch, 1);
+    shrinkLocked(cache, age);
+    pthread_mutex_unlock(&cache->m_lock);
+}
+
+//-- Maps free slabs ahead of time, they are never shrunk
+bool cacheReserve(Cache* cache, size_t slabCount, bool populate)
+{
+    bool result = true;
+    traceLock(&cache->m_lock);
+    for (size_t i = 0; i < slabCount; ++i)
     {
-        if ((void*)(iterator) <= address && (void*)((byte*)(iterator) + slabSize) >= address)
+        CSlabData* slab = initNewFreeSlab(cache, populate);
+        if (slab == NULL)
         {
-            return true;
+            result = false;
+            break;
         }
-        iterator = iterator->m_next;
+        pushSlab(&cache->m_freeSlabs, slab);
+        ++cache->m_reservedSlabs;
     }
-    return false;
+    pthread_mutex_unlock(&cache->m_lock);
+    return result;
 }
 
 bool hasAddressInCache(void* address, Cache* cache)
 {
-    CSlabData* iterator = cache->m_fullSlabs;
-    if (hasAddressInSlab(address, iterator, cache->m_slabSize))
+    return getIteratorByAddress(address, cache) != NULL;
+}
+
+//-- SL_Bitmap: check that pointer is a start of currently allocated object
+bool cacheIsObjectAllocated(Cache* cache, void* ptr)
+{
+    if (cache->m_layout != SL_Bitmap)
+    {
+        return hasAddressInCache(ptr, cache);
+    }
+    CSlabData* slab = getIteratorByAddress(ptr, cache);
+    if (slab == NULL)
+    {
+        return false;
+    }
+    const SlabGeometry* geometry = slabGeometry(cache, slab);
+    byte*               firstObject = (byte*)(slab) + geometry->m_objectOffset;
+    size_t              shift = (byte*)(ptr) - firstObject;
+    if ((byte*)(ptr) < firstObject || shift % cache->m_objectSize != 0)
+    {
+        return false;
+    }
+    size_t slot = shift / cache->m_objectSize;
+    return slot < geometry->m_slabObjects &&
+           !(atomic_load_explicit(&slab->m_freeMap[slot / 64], memory_order_relaxed) & (1ULL << (slot % 64)));
+}
+
+int slabFreeBlocks(CSlabData* slab)
+{
+    return atomic_load_explicit(&slab->m_freeBlocksCount, memory_order_relaxed);
+}
+
+const SlabGeometry* slabGeometry(Cache* cache, CSlabData* slab)
+{
+    return &cache->m_geometries[slab->m_geometry];
+}
+
+const SlabGeometry* cacheCurrentGeometry(Cache* cache)
+{
+    return &cache->m_geometries[cache->m_currentGeometry];
+}
+
+size_t slabObjectsInUse(Cache* cache, CSlabData* slab)
+{
+    if (atomic_load(&slab->m_state) == SS_Free)
     {
-        return true;
+        return 0;
     }
-    iterator = cache->m_partlyFullSlabs;
-    if (hasAddressInSlab(address, iterator, cache->m_slabSize))
+    const SlabGeometry* geometry = slabGeometry(cache, slab);
+    if (cache->m_layout != SL_Bitmap)
     {
-        return true;
+        return geometry->m_slabObjects - slabFreeBlocks(slab);
     }
-    return false;
+    size_t freeSlots = 0;
+    for (size_t i = 0; i < geometry->m_bitmapWords; ++i)
+    {
+        freeSlots += _mm_popcnt_u64(atomic_load_explicit(&slab->m_freeMap[i], memory_order_relaxed));
+    }
+    return geometry->m_slabObjects - freeSlots;
+}
+
+//-- Count of allocated objects in all slabs of the cache
+size_t cacheObjectsInUse(Cache* cache)
+{
+    size_t inUse = 0;
+    for (CSlabData* iterator = atomic_load(&cache->m_allSlabs); iterator != NULL; iterator = iterator->m_allNext)
+    {
+        inUse += slabObjectsInUse(cache, iterator);
+    }
+    return inUse;
 }
 
+//-- Slabs in address space are found by the page map, others by the walk over all slabs
 static CSlabData* getIteratorByAddress(void* address, Cache* cache)
 {
-    CSlabData* iterator = cache->m_fullSlabs;
-    while (iterator != NULL)
+    CSlabData* slab = NULL;
+    if (cache->m_space != NULL)
     {
-        if ((void*)(iterator) <= address &&
-            (void*)((byte*)(iterator) + cache->m_slabSize) >= address)
+        SpanKind kind = SK_None;
+        slab = (CSlabData*)spaceOwnerOf(cache->m_space, address, &kind);
+        if (kind != SK_Slab || slab->m_cache != cache)
         {
-            return iterator;
+            return NULL;
         }
-        iterator = iterator->m_next;
     }
-    iterator = cache->m_partlyFullSlabs;
-    while (iterator != NULL)
+    else
     {
-        if ((void*)(iterator) <= address &&
-            (void*)((byte*)(iterator) + cache->m_slabSize) >= address)
+        CSlabData* iterator = atomic_load(&cache->m_allSlabs);
+        while (iterator != NULL && slab == NULL)
         {
-            return iterator;
+            if ((void*)(iterator) <= address &&
+                (void*)((byte*)(iterator) + slabGeometry(cache, iterator)->m_slabSize) > address)
+            {
+                slab = iterator;
+            }
+            iterator = iterator->m_allNext;
         }
-        iterator = iterator->m_next;
     }
-    return NULL;
+    if (slab == NULL || atomic_load(&slab->m_state) == SS_Free)
+    {
+        return NULL;
+    }
+    return slab;
 }
 
 //-- Utilites and conf data
@@ -190,181 +372,487 @@ int countPossibleCountOfObjectsInSlab(int orderToPageSize, int objectSize)
     return (orderToPageSize - sizeof(CSlabData)) / (objectSize);
 }
 
-//-- Allocation and deallocation functions
-static void* allocSlab(int order)
+static size_t alignUp(size_t value, size_t align)
 {
-    size_t slabSize = (size_t)(1UL << order) * _sizeOfPage;
-    return mmap(NULL, slabSize, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    return (value + align - 1) & ~(align - 1);
 }
 
-static void freeSlab(void* slab, int order)
+//-- By default objects are aligned by the biggest power of two dividing their size, but not more
+//-- than cache line, bitmap goes right after the header and objects start after the bitmap
+static void layoutBitmapSlab(Cache* cache, SlabGeometry* geometry)
 {
-    //-- TODO: Chack ret val
-    size_t slabSize = (size_t)(1UL << order) * _sizeOfPage;
-    munmap(slab, slabSize);
+    size_t objects = geometry->m_slabObjects;
+    while (objects > 0)
+    {
+        size_t words = (objects + 63) / 64;
+        size_t offset = alignUp(sizeof(CSlabData) + words * sizeof(uint64_t), cache->m_objectAlign);
+        if (offset + objects * cache->m_objectSize <= (size_t)(geometry->m_slabSize))
+        {
+            geometry->m_bitmapWords = words;
+            geometry->m_objectOffset = offset;
+            break;
+        }
+        --objects;
+    }
+    geometry->m_slabObjects = objects;
 }
 
-//-- Inside cache utilites
-static void initNewFreeSlab(Cache* cache)
+//-- Geometries from the base order up to huge page size, cache starts with the smallest slabs
+static void setupGeometries(Cache* cache, int baseOrder, size_t align)
 {
-    //-- allocate slab
-    void*      buffer = allocSlab(cache->m_slabOrder);
-    CSlabData* freeSlab = (CSlabData*)buffer;
+    cache->m_objectAlign = cache->m_layout == SL_Bitmap ? align : 1;
+    int lastOrder = baseOrder > maxGrowthOrder ? baseOrder : maxGrowthOrder;
+    cache->m_geometriesCount = lastOrder - baseOrder + 1;
+    for (int i = 0; i < cache->m_geometriesCount; ++i)
+    {
+        SlabGeometry* geometry = &cache->m_geometries[i];
+        geometry->m_slabOrder = baseOrder + i;
+        geometry->m_slabSize = (1 << geometry->m_slabOrder) * _sizeOfPage;
+        geometry->m_slabObjects = countPossibleCountOfObjectsInSlab(geometry->m_slabSize, cache->m_objectSize);
+        geometry->m_objectOffset = sizeof(CSlabData);
+        geometry->m_bitmapWords = 0;
+        if (cache->m_layout == SL_Bitmap)
+        {
+            layoutBitmapSlab(cache, geometry);
+        }
+    }
+    cache->m_currentGeometry = 0;
+    cache->m_growthStreak = 0;
+}
 
-    //-- initialize slab itself
-    freeSlab->m_next = NULL;
-    freeSlab->m_prev = NULL;
-    freeSlab->m_freeBlocksCount = cache->m_slabObjects;
-    freeSlab->m_state = SS_Free;
+//-- Index of the first free slot in words [from, to), skipping empty 128 bit chunks with SSE.
+//-- Plain SSE load may see a stale word, it's only a hint: the slot is taken by atomic and in takeBlockFromSlab,
+//-- which rescans when the bit is already cleared
+static int scanFreeMap(CSlabData* slab, size_t from, size_t to)
+{
+    size_t i = from;
+#if defined(__SSE4_1__) && !defined(__SANITIZE_THREAD__)
+    for (; i + 2 <= to; i += 2)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(&slab->m_freeMap[i]));
+        if (!_mm_testz_si128(chunk, chunk))
+        {
+            break;
+        }
+    }
+#endif
+    for (; i < to; ++i)
+    {
+        uint64_t word = atomic_load_explicit(&slab->m_freeMap[i], memory_order_relaxed);
+        if (word != 0)
+        {
+            return (int)(i * 64 + __builtin_ctzll(word));
+        }
+    }
+    return -1;
+}
 
-    cache->m_freeSlabs = freeSlab;
+//-- Search starts at the hint word, so filling a slab doesn't rescan its full prefix on every
+//-- claim. Free lowers the hint, claim raises it to the word where the bit was found. A race
+//-- may leave a free bit before the hint, then the search wraps around to the slab start
+static int findFreeSlot(CSlabData* slab, size_t words)
+{
+    unsigned hint = atomic_load_explicit(&slab->m_freeHint, memory_order_relaxed);
+    int      slot = scanFreeMap(slab, hint, words);
+    if (slot < 0)
+    {
+        slot = scanFreeMap(slab, 0, hint < words ? hint : words);
+    }
+    if (slot >= 0 && (unsigned)(slot / 64) != hint)
+    {
+        atomic_compare_exchange_strong_explicit(&slab->m_freeHint, &hint, (unsigned)(slot / 64),
+                                                memory_order_relaxed, memory_order_relaxed);
+    }
+    return slot;
+}
+
+//-- Slot is already paid by decrement of the free blocks counter, so a free bit exists,
+//-- freeBlocksBefore is the counter value before the decrement
+static void* takeBlockFromSlab(Cache* cache, CSlabData* slab, int freeBlocksBefore)
+{
+    const SlabGeometry* geometry = slabGeometry(cache, slab);
+    if (cache->m_layout != SL_Bitmap)
+    {
+        return (void*)((byte*)(slab) + sizeof(CSlabData) +
+                       ((geometry->m_slabObjects - freeBlocksBefore) * cache->m_objectSize));
+    }
+    for (;;)
+    {
+        int slot = findFreeSlot(slab, geometry->m_bitmapWords);
+        if (slot < 0)
+        {
+            //-- Counter decrement already paid for a slot, so a bit must appear once a concurrent free sets it
+            _mm_pause();
+            continue;
+        }
+        uint64_t bit = 1ULL << (slot % 64);
+        if (atomic_fetch_and(&slab->m_freeMap[slot / 64], ~bit) & bit)
+        {
+            return (void*)((byte*)(slab) + geometry->m_objectOffset + slot * cache->m_objectSize);
+        }
+    }
 }
 
-static CSlabData* getIteratorByState(Cache* cache, SlabState state)
+//-- Claims one block of open slab, NULL if slab is full or closed
+static void* claimBlock(Cache* cache, CSlabData* slab)
 {
-    CSlabData* iterator = NULL;
+    int freeBlocks = atomic_load_explicit(&slab->m_freeBlocksCount, memory_order_relaxed);
+    do
+    {
+        if (freeBlocks <= 0)
+        {
+            return NULL;
+        }
+    } while (!atomic_compare_exchange_weak(&slab->m_freeBlocksCount, &freeBlocks, freeBlocks - 1));
 
-    switch (state)
+    if ((size_t)freeBlocks == slabGeometry(cache, slab)->m_slabObjects)
     {
-        case SS_Free:
-            iterator = cache->m_freeSlabs;
-            break;
-        case SS_PartlyFull:
-            iterator = cache->m_partlyFullSlabs;
-            break;
-        case SS_Full:
-            iterator = cache->m_fullSlabs;
-            break;
-        default:
-            break;
+        atomic_fetch_sub(&cache->m_emptySlabs, 1);
     }
+    return takeBlockFromSlab(cache, slab, freeBlocks);
+}
 
-    return iterator;
+//-- Marks block as free, returns false if block can't be freed (double free or wrong pointer)
+static bool putBlockToSlab(Cache* cache, CSlabData* slab, void* ptr)
+{
+    if (cache->m_layout == SL_Bitmap)
+    {
+        if (!cacheIsObjectAllocated(cache, ptr))
+        {
+            return false;
+        }
+        byte*    firstObject = (byte*)(slab) + slabGeometry(cache, slab)->m_objectOffset;
+        size_t   slot = ((byte*)(ptr) - firstObject) / cache->m_objectSize;
+        uint64_t bit = 1ULL << (slot % 64);
+        //-- Racing double free loses here
+        if (atomic_fetch_or(&slab->m_freeMap[slot / 64], bit) & bit)
+        {
+            return false;
+        }
+        unsigned hint = atomic_load_explicit(&slab->m_freeHint, memory_order_relaxed);
+        while (slot / 64 < hint && !atomic_compare_exchange_weak_explicit(&slab->m_freeHint, &hint,
+                                                                           (unsigned)(slot / 64),
+                                                                           memory_order_relaxed, memory_order_relaxed))
+        {
+        }
+    }
+    return true;
 }
 
-static CSlabData** getListByState(Cache* cache, SlabState state)
+//-- Tagged stacks of slabs
+static inline CSlabData* slabOf(uint64_t head)
 {
-    CSlabData** iterator = NULL;
+    return (CSlabData*)(uintptr_t)(head & slabPointerMask);
+}
 
-    switch (state)
+static inline uint64_t nextHead(uint64_t head, CSlabData* slab)
+{
+    return (uint64_t)(uintptr_t)(slab) | (((head >> slabTagShift) + 1) << slabTagShift);
+}
+
+static void pushSlab(_Atomic(uint64_t)* stack, CSlabData* slab)
+{
+    uint64_t head = atomic_load(stack);
+    do
     {
-        case SS_Free:
-            iterator = &cache->m_freeSlabs;
-            break;
-        case SS_PartlyFull:
-            iterator = &cache->m_partlyFullSlabs;
-            break;
-        case SS_Full:
-            iterator = &cache->m_fullSlabs;
-            break;
-        default:
-            break;
+        atomic_store_explicit(&slab->m_next, slabOf(head), memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak(stack, &head, nextHead(head, slab)));
+}
+
+//-- Stale head may point to a slab which is already in another stack, it's still readable
+//-- and tag makes CAS fail
+static CSlabData* popSlab(_Atomic(uint64_t)* stack)
+{
+    uint64_t head = atomic_load(stack);
+    while (slabOf(head) != NULL)
+    {
+        CSlabData* next = atomic_load_explicit(&slabOf(head)->m_next, memory_order_relaxed);
+        if (atomic_compare_exchange_weak(stack, &head, nextHead(head, next)))
+        {
+            return slabOf(head);
+        }
     }
+    return NULL;
+}
 
-    return iterator;
+//-- Takes the whole stack, slabs are linked by m_next
+static CSlabData* detachSlabs(_Atomic(uint64_t)* stack)
+{
+    uint64_t head = atomic_load(stack);
+    while (!atomic_compare_exchange_weak(stack, &head, nextHead(head, NULL)))
+    {
+    }
+    return slabOf(head);
+}
+
+//-- Allocation and deallocation functions
+static void* allocSlab(Cache* cache, const SlabGeometry* geometry, bool populate)
+{
+    size_t slabSize = (size_t)(geometry->m_slabSize);
+    if (cache->m_space != NULL)
+    {
+        return spaceCommit(cache->m_space, slabSize, SK_Slab, populate);
+    }
+    int   flags = MAP_ANONYMOUS | MAP_PRIVATE | (populate ? MAP_POPULATE : 0);
+    void* slab = mmap(NULL, slabSize, PROT_READ | PROT_WRITE, flags, -1, 0);
+    return slab != MAP_FAILED ? slab : NULL;
 }
 
-static bool isSlabAHead(Cache* cache, CSlabData* pos)
+static void freeSlab(Cache* cache, void* slab)
 {
-    return pos == cache->m_freeSlabs || pos == cache->m_partlyFullSlabs ||
-           pos == cache->m_fullSlabs;
+    //-- TODO: Chack ret val
+    size_t slabSize = (size_t)(slabGeometry(cache, (CSlabData*)(slab))->m_slabSize);
+    TRACE_EVENT(TE_SlabDestroy, slabSize);
+    if (cache->m_space != NULL)
+    {
+        spaceDecommit(cache->m_space, slab, slabSize);
+        return;
+    }
+    munmap(slab, slabSize);
 }
 
-static void moveSlab(Cache* cache, CSlabData* pos, SlabState whereToMove, SlabState fromMoved)
+//-- Object cache callbacks run over every slot of the slab
+static void constructObjects(Cache* cache, CSlabData* slab)
 {
-    if (pos && isSlabAHead(cache, pos))
+    if (cache->m_ctor != NULL)
     {
-        CSlabData** slab = getListByState(cache, fromMoved);
-        *slab = pos->m_next;
+        const SlabGeometry* geometry = slabGeometry(cache, slab);
+        byte*               object = (byte*)(slab) + geometry->m_objectOffset;
+        for (size_t i = 0; i < geometry->m_slabObjects; ++i, object += cache->m_objectSize)
+        {
+            cache->m_ctor(object, cache->m_callbackArg);
+        }
     }
+    slab->m_constructed = true;
+}
 
-    if (pos->m_prev)
+static void destructObjects(Cache* cache, CSlabData* slab)
+{
+    if (slab->m_constructed && cache->m_dtor != NULL)
     {
-        pos->m_prev->m_next = pos->m_next;
+        const SlabGeometry* geometry = slabGeometry(cache, slab);
+        byte*               object = (byte*)(slab) + geometry->m_objectOffset;
+        for (size_t i = 0; i < geometry->m_slabObjects; ++i, object += cache->m_objectSize)
+        {
+            cache->m_dtor(object, cache->m_callbackArg);
+        }
     }
+    slab->m_constructed = false;
+}
+
+//-- Pages with objects are given back, header pages stay since stale pointers may read them
+static size_t slabHeaderPagesSize(Cache* cache, CSlabData* slab)
+{
+    const SlabGeometry* geometry = slabGeometry(cache, slab);
+    size_t              headerSize = alignUp(geometry->m_objectOffset, _sizeOfPage);
+    return headerSize < (size_t)(geometry->m_slabSize) ? headerSize : (size_t)(geometry->m_slabSize);
+}
 
-    if (pos->m_next)
+static void releaseSlabBody(Cache* cache, CSlabData* slab)
+{
+    destructObjects(cache, slab);
+    size_t headerSize = slabHeaderPagesSize(cache, slab);
+    size_t bodySize = (size_t)(slabGeometry(cache, slab)->m_slabSize) - headerSize;
+    TRACE_EVENT(TE_SlabRelease, bodySize);
+    if (cache->m_space != NULL)
+    {
+        spaceDiscard(cache->m_space, (byte*)(slab) + headerSize, bodySize);
+    }
+    else
     {
-        pos->m_next->m_prev = pos->m_prev;
+        madvise((byte*)(slab) + headerSize, bodySize, MADV_DONTNEED);
     }
+    slab->m_bodyReleased = true;
+    atomic_fetch_sub(&cache->m_slabsCount, 1);
+}
 
-    CSlabData** iterator = getListByState(cache, whereToMove);
+//-- Inside cache utilites
+//-- New slab is closed and not in any stack, has to be called under m_lock
+static CSlabData* initNewFreeSlab(Cache* cache, bool populate)
+{
+    //-- allocate slab
+    const SlabGeometry* geometry = cacheCurrentGeometry(cache);
+    void*               buffer = allocSlab(cache, geometry, populate);
+    if (buffer == NULL)
+    {
+        return NULL;
+    }
+    TRACE_EVENT(TE_SlabCreate, geometry->m_slabSize);
+    CSlabData* freeSlab = (CSlabData*)buffer;
+    atomic_fetch_add(&cache->m_slabsCount, 1);
 
-    pos->m_prev = NULL;
-    pos->m_next = *iterator;
-    if (*iterator)
+    //-- initialize slab itself
+    freeSlab->m_cache = cache;
+    atomic_init(&freeSlab->m_next, NULL);
+    atomic_init(&freeSlab->m_freeBlocksCount, 0);
+    atomic_init(&freeSlab->m_state, SS_Free);
+    atomic_init(&freeSlab->m_listed, false);
+    atomic_init(&freeSlab->m_emptyEpoch, atomic_load(&cache->m_epoch));
+    freeSlab->m_bodyReleased = false;
+    freeSlab->m_constructed = false;
+    freeSlab->m_geometry = cache->m_currentGeometry;
+    atomic_init(&freeSlab->m_freeHint, 0);
+
+    if (cache->m_layout == SL_Bitmap)
     {
-        (*iterator)->m_prev = pos;
+        for (size_t i = 0; i < geometry->m_bitmapWords; ++i)
+        {
+            size_t slotsInWord = geometry->m_slabObjects - i * 64;
+            atomic_init(&freeSlab->m_freeMap[i], slotsInWord >= 64 ? ~0ULL : (1ULL << slotsInWord) - 1);
+        }
     }
-    (*getListByState(cache, whereToMove)) = pos;
+
+    freeSlab->m_allNext = atomic_load(&cache->m_allSlabs);
+    atomic_store(&cache->m_allSlabs, freeSlab);
+    return freeSlab;
 }
 
+//-- Opens closed slab owned by the caller, takes its first block and publishes it in
+//-- partly full stack if something is left
 static void* getFreeBlockFromFreeSlab(Cache* cache)
 {
-    CSlabData* currentSlab = cache->m_freeSlabs;
-    void*      retPointer = (void*)((byte*)(currentSlab) + sizeof(CSlabData));
-
-    --currentSlab->m_freeBlocksCount;
-    currentSlab->m_state = SS_PartlyFull;
+    CSlabData* currentSlab = popSlab(&cache->m_freeSlabs);
+    if (currentSlab == NULL)
+    {
+        traceLock(&cache->m_lock);
+        currentSlab = initNewFreeSlab(cache, false);
+        //-- Big slab may not fit under the limit while a smaller one still does
+        while (currentSlab == NULL && cache->m_currentGeometry > 0)
+        {
+            --cache->m_currentGeometry;
+            cache->m_growthStreak = 0;
+            currentSlab = initNewFreeSlab(cache, false);
+        }
+        //-- Slabs are created one after another: next ones will be bigger
+        if (currentSlab != NULL && ++cache->m_growthStreak >= slabGrowthStreak &&
+            cache->m_currentGeometry + 1 < cache->m_geometriesCount)
+        {
+            ++cache->m_currentGeometry;
+            cache->m_growthStreak = 0;
+        }
+        pthread_mutex_unlock(&cache->m_lock);
+        if (currentSlab == NULL)
+        {
+            return NULL;
+        }
+    }
+    if (currentSlab->m_bodyReleased)
+    {
+        //-- Pages of the body are counted by the space again, slab stays closed if it passes the limit
+        size_t bodySize =
+            (size_t)(slabGeometry(cache, currentSlab)->m_slabSize) - slabHeaderPagesSize(cache, currentSlab);
+        if (cache->m_space != NULL && !spaceReclaim(cache->m_space, bodySize, true))
+        {
+            pushSlab(&cache->m_freeSlabs, currentSlab);
+            return NULL;
+        }
+        currentSlab->m_bodyReleased = false;
+        atomic_fetch_add(&cache->m_slabsCount, 1);
+    }
+    if (!currentSlab->m_constructed)
+    {
+        constructObjects(cache, currentSlab);
+    }
 
-    moveSlab(cache, currentSlab, SS_PartlyFull, SS_Free);
+    int freeBlocks = (int)(slabGeometry(cache, currentSlab)->m_slabObjects);
+    atomic_store(&currentSlab->m_freeBlocksCount, freeBlocks - 1);
+    void* retPointer = takeBlockFromSlab(cache, currentSlab, freeBlocks);
 
+    if (freeBlocks - 1 == 0)
+    {
+        atomic_store(&currentSlab->m_state, SS_Full);
+        return retPointer;
+    }
+    atomic_store(&currentSlab->m_state, SS_PartlyFull);
+    atomic_store(&currentSlab->m_listed, true);
+    pushSlab(&cache->m_partlyFullSlabs, currentSlab);
     return retPointer;
 }
 
 static void* getFreeBlockFromPartlyFullSlab(Cache* cache)
 {
-    CSlabData* currentSlab = cache->m_partlyFullSlabs;
-
-    void* retPointer = (void*)((byte*)(currentSlab) + sizeof(CSlabData) + ((cache->m_slabObjects - currentSlab->m_freeBlocksCount) * cache->m_objectSize));
-    --currentSlab->m_freeBlocksCount;
-
-    if (currentSlab->m_freeBlocksCount == 0)
+    uint64_t head = atomic_load(&cache->m_partlyFullSlabs);
+    while (slabOf(head) != NULL)
     {
-        currentSlab->m_state = SS_Full;
-        moveSlab(cache, currentSlab, SS_Full, SS_PartlyFull);
-    }
+        CSlabData* currentSlab = slabOf(head);
+        void*      retPointer = claimBlock(cache, currentSlab);
+        if (retPointer != NULL)
+        {
+            return retPointer;
+        }
 
-    return retPointer;
+        //-- Slab is full, take it off the stack unless somebody did it already
+        CSlabData* next = atomic_load_explicit(&currentSlab->m_next, memory_order_relaxed);
+        if (atomic_compare_exchange_strong(&cache->m_partlyFullSlabs, &head, nextHead(head, next)))
+        {
+            atomic_store(&currentSlab->m_state, SS_Full);
+            atomic_store(&currentSlab->m_listed, false);
+            //-- Block could be freed after our claim failed, but before the slab was unlisted
+            bool listed = false;
+            if (slabFreeBlocks(currentSlab) > 0 &&
+                atomic_compare_exchange_strong(&currentSlab->m_listed, &listed, true))
+            {
+                atomic_store(&currentSlab->m_state, SS_PartlyFull);
+                pushSlab(&cache->m_partlyFullSlabs, currentSlab);
+            }
+            head = atomic_load(&cache->m_partlyFullSlabs);
+        }
+    }
+    return NULL;
 }
 
-static void letTheSlabGo(Cache* cache, SlabState stateToFree)
+//-- Slab is empty at least for age ticks of cache epoch
+static bool slabIsOld(Cache* cache, CSlabData* slab, unsigned age)
 {
-    CSlabData* next = NULL;
-    CSlabData* iterator = getIteratorByState(cache, stateToFree);
+    return atomic_load(&cache->m_epoch) - atomic_load(&slab->m_emptyEpoch) >= age;
+}
 
-    while (iterator)
+//-- Closes open slab if it has no allocated objects, after that no slot can be claimed
+static bool closeEmptySlab(Cache* cache, CSlabData* slab)
+{
+    int freeBlocks = (int)(slabGeometry(cache, slab)->m_slabObjects);
+    if (!atomic_compare_exchange_strong(&slab->m_freeBlocksCount, &freeBlocks, 0))
     {
-        next = iterator->m_next;
-        freeSlab((void*)(iterator), cache->m_slabOrder);
-        iterator = next;
+        return false;
     }
-
-    (*getListByState(cache, stateToFree)) = NULL;
+    atomic_fetch_sub(&cache->m_emptySlabs, 1);
+    atomic_store(&slab->m_state, SS_Free);
+    atomic_store(&slab->m_listed, false);
+    return true;
 }
 
-static int countSlabs(Cache* cache, SlabState stateToCount)
+//-- Slabs empty for at least age ticks are moved from partly full stack to free stack,
+//-- then pages of such free slabs above the reserve are given back to the system
+static void shrinkLocked(Cache* cache, unsigned age)
 {
-    int        count = 0;
-    CSlabData* countSlab = NULL;
-    switch (stateToCount)
+    CSlabData* iterator = detachSlabs(&cache->m_partlyFullSlabs);
+    while (iterator != NULL)
     {
-        case SS_Free:
-            countSlab = cache->m_freeSlabs;
-            break;
-        case SS_PartlyFull:
-            countSlab = cache->m_partlyFullSlabs;
-            break;
-        case SS_Full:
-            countSlab = cache->m_fullSlabs;
-            break;
-        default:
-            break;
+        CSlabData* next = atomic_load_explicit(&iterator->m_next, memory_order_relaxed);
+        bool       closed = slabIsOld(cache, iterator, age) && closeEmptySlab(cache, iterator);
+        pushSlab(closed ? &cache->m_freeSlabs : &cache->m_partlyFullSlabs, iterator);
+        iterator = next;
     }
-    while (countSlab != NULL)
+
+    bool released = false;
+    iterator = detachSlabs(&cache->m_freeSlabs);
+    while (iterator != NULL)
+    {
+        CSlabData* next = atomic_load_explicit(&iterator->m_next, memory_order_relaxed);
+        if (!iterator->m_bodyReleased && atomic_load(&cache->m_slabsCount) > cache->m_reservedSlabs &&
+            slabIsOld(cache, iterator, age))
+        {
+            releaseSlabBody(cache, iterator);
+            released = true;
+        }
+        pushSlab(&cache->m_freeSlabs, iterator);
+        iterator = next;
+    }
+
+    //-- Memory was left unused: next slabs will be smaller
+    if (released)
     {
-        ++count;
-        countSlab = countSlab->m_next;
+        cache->m_growthStreak = 0;
+        cache->m_currentGeometry -= cache->m_currentGeometry > 0 ? 1 : 0;
     }
-    return count;
 }
@@ -0,0 +1,239 @@
+//-- Tail latency benchmark: every malloc and free is timed with rdtsc, latencies go to log-linear
+//-- histograms per size range. Memory syscalls of eh_malloc are counted by the wrappers below,
+//-- the library calls them through PLT so the definitions of the executable are taken
+#define _GNU_SOURCE
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <x86intrin.h>
+#include "eh_malloc.h"
+
+#define BENCH_OPS          1000000
+#define HISTOGRAM_SUB_BITS 4 /* 16 sub-buckets per power of two, error is below 1/16 */
+#define HISTOGRAM_BUCKETS  (64 << HISTOGRAM_SUB_BITS)
+
+static atomic_size_t mapCalls;
+static atomic_size_t unmapCalls;
+
+void* mmap(void* address, size_t length, int prot, int flags, int fd, off_t offset)
+{
+    atomic_fetch_add(&mapCalls, 1);
+    return (void*)syscall(SYS_mmap, address, length, prot, flags, fd, offset);
+}
+
+int munmap(void* address, size_t length)
+{
+    atomic_fetch_add(&unmapCalls, 1);
+    return (int)syscall(SYS_munmap, address, length);
+}
+
+//-- Commit of the address space
+int mprotect(void* address, size_t length, int prot)
+{
+    atomic_fetch_add(prot != PROT_NONE ? &mapCalls : &unmapCalls, 1);
+    return (int)syscall(SYS_mprotect, address, length, prot);
+}
+
+//-- Decommit, discard and purge
+int madvise(void* address, size_t length, int advice)
+{
+    atomic_fetch_add(advice == MADV_DONTNEED ? &unmapCalls : &mapCalls, 1);
+    return (int)syscall(SYS_madvise, address, length, advice);
+}
+
+typedef struct SHistogram
+{
+    uint64_t m_counts[HISTOGRAM_BUCKETS];
+    uint64_t m_total;
+    uint64_t m_max;
+} Histogram;
+
+//-- Values below 2^SUB_BITS have their own bucket, others keep SUB_BITS bits after the highest one
+static int bucketOf(uint64_t value)
+{
+    if (value < (1 << HISTOGRAM_SUB_BITS))
+    {
+        return (int)(value);
+    }
+    int exponent = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    return ((exponent + 1) << HISTOGRAM_SUB_BITS) + (int)((value >> exponent) & ((1 << HISTOGRAM_SUB_BITS) - 1));
+}
+
+//-- Highest value of the bucket
+static uint64_t bucketValue(int bucket)
+{
+    if (bucket < (1 << HISTOGRAM_SUB_BITS))
+    {
+        return (uint64_t)(bucket);
+    }
+    int      exponent = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+    uint64_t mantissa = (uint64_t)((bucket & ((1 << HISTOGRAM_SUB_BITS) - 1)) | (1 << HISTOGRAM_SUB_BITS));
+    return ((mantissa + 1) << exponent) - 1;
+}
+
+static void record(Histogram* histogram, uint64_t value)
+{
+    ++histogram->m_counts[bucketOf(value)];
+    ++histogram->m_total;
+    histogram->m_max = value > histogram->m_max ? value : histogram->m_max;
+}
+
+static uint64_t percentile(Histogram* histogram, double percent)
+{
+    uint64_t rank = (uint64_t)((double)(histogram->m_total) * percent / 100.0);
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+    {
+        seen += histogram->m_counts[i];
+        if (seen > rank)
+        {
+            uint64_t value = bucketValue(i);
+            return value < histogram->m_max ? value : histogram->m_max;
+        }
+    }
+    return histogram->m_max;
+}
+
+static inline uint64_t readTsc()
+{
+    _mm_lfence();
+    uint64_t tsc = __rdtsc();
+    _mm_lfence();
+    return tsc;
+}
+
+static double cyclesPerNs;
+
+static void calibrateTsc()
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t tscStart = readTsc();
+    struct timespec pause = {0, 50 * 1000 * 1000};
+    nanosleep(&pause, NULL);
+    uint64_t tscEnd = readTsc();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ns = (double)(end.tv_sec - start.tv_sec) * 1e9 + (double)(end.tv_nsec - start.tv_nsec);
+    cyclesPerNs = (double)(tscEnd - tscStart) / ns;
+}
+
+typedef struct SAllocator
+{
+    const char* m_name;
+    void* (*m_malloc)(size_t);
+    void (*m_free)(void*);
+    bool m_countsSyscalls;
+} Allocator;
+
+typedef struct SSizeRange
+{
+    size_t m_min;
+    size_t m_max;
+    int    m_slots; /* live blocks kept by the workload */
+} SizeRange;
+
+static uint64_t nextRandom(uint64_t* state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static void printRow(const char* allocator, const char* op, const SizeRange* range, Histogram* histogram)
+{
+    printf("%-14s %-6s %8zu-%-8zu %8.0f %8.0f %8.0f %10.0f", allocator, op, range->m_min, range->m_max,
+           (double)(percentile(histogram, 50.0)) / cyclesPerNs, (double)(percentile(histogram, 99.0)) / cyclesPerNs,
+           (double)(percentile(histogram, 99.9)) / cyclesPerNs, (double)(histogram->m_max) / cyclesPerNs);
+}
+
+//-- Random slot is freed if it's taken and allocated otherwise, so about half of slots are live
+static void runRange(const Allocator* allocator, const SizeRange* range)
+{
+    static Histogram mallocLatency, freeLatency;
+    memset(&mallocLatency, 0, sizeof(mallocLatency));
+    memset(&freeLatency, 0, sizeof(freeLatency));
+    char**   slots = calloc((size_t)(range->m_slots), sizeof(char*));
+    uint64_t state = 88172645463325252ULL;
+
+    size_t mapBefore = atomic_load(&mapCalls);
+    size_t unmapBefore = atomic_load(&unmapCalls);
+    for (int i = 0; i < BENCH_OPS; ++i)
+    {
+        int slot = (int)(nextRandom(&state) % (uint64_t)(range->m_slots));
+        if (slots[slot] != NULL)
+        {
+            uint64_t start = readTsc();
+            allocator->m_free(slots[slot]);
+            record(&freeLatency, readTsc() - start);
+            slots[slot] = NULL;
+            continue;
+        }
+        size_t   size = range->m_min + (size_t)(nextRandom(&state) % (range->m_max - range->m_min + 1));
+        uint64_t start = readTsc();
+        slots[slot] = allocator->m_malloc(size);
+        record(&mallocLatency, readTsc() - start);
+        if (slots[slot] == NULL)
+        {
+            fprintf(stderr, "%s failed to allocate %zu bytes\n", allocator->m_name, size);
+            abort();
+        }
+        //-- Page faults of the first touch are left out of the measurement
+        slots[slot][0] = 1;
+        slots[slot][size - 1] = 1;
+    }
+    size_t maps = atomic_load(&mapCalls) - mapBefore;
+    size_t unmaps = atomic_load(&unmapCalls) - unmapBefore;
+    for (int i = 0; i < range->m_slots; ++i)
+    {
+        allocator->m_free(slots[i]);
+    }
+    free(slots);
+
+    printRow(allocator->m_name, "malloc", range, &mallocLatency);
+    if (allocator->m_countsSyscalls)
+    {
+        printf(" %10.1f %10.1f\n", (double)(maps) * 1e6 / BENCH_OPS, (double)(unmaps) * 1e6 / BENCH_OPS);
+    }
+    else
+    {
+        printf(" %10s %10s\n", "-", "-");
+    }
+    printRow(allocator->m_name, "free", range, &freeLatency);
+    printf("\n");
+}
+
+int main()
+{
+    calibrateTsc();
+    const SizeRange ranges[] = {
+        {1, 64, 4096},           /* small slabs */
+        {65, 512, 4096},         /* medium slabs */
+        {513, 4096, 4096},       /* big slabs */
+        {4097, 65536, 1024},     /* BT heaps */
+        {65537, 1048576, 128},   /* large BT heaps */
+    };
+    //-- System malloc maps from inside libc, its calls can't be wrapped
+    const Allocator allocators[] = {
+        {"eh_malloc", eh_malloc, eh_free, true},
+        {"system malloc", malloc, free, false},
+    };
+
+    printf("%d operations per range, latencies in ns, syscalls per 1M operations\n", BENCH_OPS);
+    printf("%-14s %-6s %17s %8s %8s %8s %10s %10s %10s\n", "allocator", "op", "size", "p50", "p99", "p99.9",
+           "max", "map", "unmap");
+    for (size_t i = 0; i < sizeof(ranges) / sizeof(ranges[0]); ++i)
+    {
+        for (size_t j = 0; j < sizeof(allocators) / sizeof(allocators[0]); ++j)
+        {
+            runRange(&allocators[j], &ranges[i]);
+        }
+    }
+    return 0;
+}
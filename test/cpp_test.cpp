@@ -0,0 +1,131 @@
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+#include "eh_malloc.hpp"
+
+void test_stl_allocator()
+{
+    printf("Testing STL allocator...\n");
+    std::vector<int, eh::allocator<int>> numbers;
+    for (int i = 0; i < 100000; ++i)
+    {
+        numbers.push_back(i);
+    }
+    for (int i = 0; i < 100000; ++i)
+    {
+        assert(numbers[i] == i);
+    }
+
+    std::map<int, std::string, std::less<int>, eh::allocator<std::pair<const int, std::string>>> names;
+    for (int i = 0; i < 1000; ++i)
+    {
+        names[i] = std::to_string(i);
+    }
+    for (int i = 0; i < 1000; ++i)
+    {
+        assert(names[i] == std::to_string(i));
+    }
+    assert(eh::allocator<int>() == eh::allocator<long>());
+    printf("STL allocator passed.\n");
+}
+
+void test_malloc_resource()
+{
+    printf("Testing malloc resource...\n");
+    std::pmr::memory_resource* resource = eh::pmr::get_malloc_resource();
+    std::pmr::vector<std::pmr::string> strings(resource);
+    for (int i = 0; i < 1000; ++i)
+    {
+        strings.emplace_back(std::to_string(i) + " is a string long enough to skip small buffer");
+    }
+    assert(strings[999].substr(0, 3) == "999");
+
+    for (std::size_t alignment = 32; alignment <= 4096; alignment *= 2)
+    {
+        void* block = resource->allocate(100, alignment);
+        assert(reinterpret_cast<std::uintptr_t>(block) % alignment == 0);
+        resource->deallocate(block, 100, alignment);
+    }
+    assert(resource->is_equal(*eh::pmr::get_malloc_resource()));
+    printf("Malloc resource passed.\n");
+}
+
+void test_slab_pool_resource()
+{
+    printf("Testing slab pool resource...\n");
+    eh::pmr::slab_pool_resource pool;
+    {
+        std::pmr::list<int> numbers(&pool);
+        for (int i = 0; i < 10000; ++i)
+        {
+            numbers.push_back(i);
+        }
+        int expected = 0;
+        for (int number : numbers)
+        {
+            assert(number == expected++);
+        }
+
+        //-- Big and over-aligned blocks go upstream
+        void* big = pool.allocate(10000, 16);
+        void* aligned = pool.allocate(64, 256);
+        assert(reinterpret_cast<std::uintptr_t>(aligned) % 256 == 0);
+        pool.deallocate(big, 10000, 16);
+        pool.deallocate(aligned, 64, 256);
+    }
+    void* block = pool.allocate(48, 16);
+    assert(reinterpret_cast<std::uintptr_t>(block) % 16 == 0);
+    pool.release();
+    assert(!pool.is_equal(*eh::pmr::get_malloc_resource()));
+    printf("Slab pool resource passed.\n");
+}
+
+struct alignas(256) Aligned
+{
+    char m_data[300];
+};
+
+void test_operator_new()
+{
+    printf("Testing operator new...\n");
+    std::size_t mappedBefore = eh_mapped_bytes();
+    char*       big = new char[64 << 20];
+    big[(64 << 20) - 1] = 1;
+    assert(eh_mapped_bytes() >= mappedBefore + (64 << 20));
+    delete[] big;
+
+    std::vector<Aligned*> aligned;
+    for (int i = 0; i < 1000; ++i)
+    {
+        aligned.push_back(new Aligned());
+        assert(reinterpret_cast<std::uintptr_t>(aligned.back()) % 256 == 0);
+    }
+    for (Aligned* object : aligned)
+    {
+        delete object;
+    }
+    Aligned* alignedArray = new Aligned[10];
+    assert(reinterpret_cast<std::uintptr_t>(alignedArray) % 256 == 0);
+    delete[] alignedArray;
+
+    int* number = new (std::nothrow) int(42);
+    assert(number != nullptr && *number == 42);
+    delete number;
+    volatile std::size_t huge = std::size_t(1) << 62;
+    assert(operator new(huge, std::nothrow) == nullptr);
+    printf("Operator new passed.\n");
+}
+
+int main()
+{
+    test_stl_allocator();
+    test_malloc_resource();
+    test_slab_pool_resource();
+    test_operator_new();
+    printf("All C++ tests completed.\n");
+    return 0;
+}
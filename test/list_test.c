@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include "eh_malloc.h"
+#include "eh_malloc_inline.h"
 
 typedef struct ListNode
 {
@@ -10,7 +11,7 @@ typedef struct ListNode
 
 ListNode* createNode(int data)
 {
-    ListNode* newNode = (ListNode*)eh_malloc(sizeof(ListNode));
+    ListNode* newNode = (ListNode*)eh_malloc_inline(sizeof(ListNode));
     if (newNode == NULL)
     {
         return NULL;
@@ -25,7 +26,7 @@ void deleteNode(ListNode* node)
 {
     if (node != NULL)
     {
-        eh_free(node);
+        eh_free_inline(node, sizeof(ListNode));
     }
 }
 
@@ -1,9 +1,19 @@
+#define _GNU_SOURCE
 #include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 #include <time.h>
+#include <unistd.h>
+#include "border_tags_allocator.h"
 #include "eh_malloc.h"
+#include "eh_malloc_inline.h"
+#include "persistent_heap.h"
 
 void test_basic_allocation()
 {
@@ -234,6 +244,1003 @@ void test_large_complex_allocation_and_data_integrity()
     }
 }
 
+//-- Free blocks are indexed by size, so a request goes to the smallest hole which fits
+void test_bt_best_fit()
+{
+    printf("Testing BT best fit...\n");
+    static char buffer[256 << 10];
+    BTagsHeap   heap;
+    setupBTagsAllocator(buffer, sizeof(buffer), &heap);
+    char* largeHole = BTAlloc(40000, &heap);
+    char* separator = BTAlloc(64, &heap);
+    char* smallHole = BTAlloc(8000, &heap);
+    char* tail = BTAlloc(64, &heap);
+    //-- Rest of the buffer is taken, so the large hole becomes the largest free block
+    char* filler = BTAlloc(heap.m_largestFree - sizeof(BlockHeader), &heap);
+    assert(largeHole && separator && smallHole && tail && filler && heap.m_largestFree == 0);
+    BTFree(largeHole, &heap);
+    BTFree(smallHole, &heap);
+    BTFlushQuickLists(&heap);
+
+    BTagsStats before;
+    BTCollectStats(&heap, &before);
+    assert(before.m_freeBlocks == 2);
+    char* block = BTAlloc(6000, &heap);
+    assert(block >= smallHole && block < smallHole + 8000);
+    BTagsStats after;
+    BTCollectStats(&heap, &after);
+    assert(after.m_largestFree == before.m_largestFree && after.m_largestFree >= 40000);
+    printf("BT best fit passed.\n");
+}
+
+void test_slab_slots_reuse()
+{
+    printf("Testing slab slots reuse...\n");
+    char* keepSlabAlive = eh_malloc(32);
+    char* first = eh_malloc(32);
+    char* second = eh_malloc(32);
+    eh_free(first);
+    char* third = eh_malloc(32);
+    if (third == second)
+    {
+        printf("Slab slots reuse test failed: live object was returned twice\n");
+        exit(1);
+    }
+    memset(second, 0x11, 32);
+    memset(third, 0x22, 32);
+    assert(second[0] == 0x11 && third[0] == 0x22);
+    eh_free(third);
+    eh_free(third);  // double free has to be ignored
+    char* fourth = eh_malloc(32);
+    char* fifth = eh_malloc(32);
+    assert(fourth != fifth && fourth != second && fifth != second);
+    eh_free(fourth);
+    eh_free(fifth);
+    eh_free(second);
+    eh_free(keepSlabAlive);
+
+    //-- Slot freed below the words already filled is the first one found again, objects stay
+    //-- in the first slab which keeps at least minObjectCount of them
+    Cache* cache = eh_cache_create(64, 16, NULL, NULL, NULL);
+    assert(cache != NULL);
+    char* objects[100];
+    for (int i = 0; i < 100; ++i)
+    {
+        objects[i] = eh_cache_alloc(cache);
+        assert(objects[i] != NULL);
+    }
+    eh_cache_free(cache, objects[3]);
+    assert(eh_cache_alloc(cache) == objects[3]);
+    for (int i = 0; i < 100; ++i)
+    {
+        eh_cache_free(cache, objects[i]);
+    }
+    eh_cache_destroy(cache);
+    printf("Slab slots reuse passed.\n");
+}
+
+void test_large_blocks_integrity()
+{
+    printf("Testing large blocks integrity...\n");
+    const int    count = 8;
+    const size_t size = 10000;
+    char*        blocks[count];
+    for (int i = 0; i < count; i++)
+    {
+        blocks[i] = eh_malloc(size);
+        assert(blocks[i] != NULL);
+        assert(((size_t)(blocks[i]) & 15) == 0);
+        memset(blocks[i], i + 1, size);
+    }
+    for (int i = 1; i < count; i += 2)
+    {
+        eh_free(blocks[i]);
+    }
+    char* joined = eh_malloc(size * 2);
+    assert(joined != NULL);
+    memset(joined, 0x7F, size * 2);
+    for (int i = 0; i < count; i += 2)
+    {
+        assert(blocks[i][0] == i + 1 && blocks[i][size - 1] == i + 1);
+        eh_free(blocks[i]);
+    }
+    eh_free(joined);
+
+    //-- Blocks over 2 GiB have to be supported by tags
+    size_t hugeSize = 3UL << 30;
+    char*  huge = eh_malloc(hugeSize);
+    if (huge == NULL)
+    {
+        printf("Failed to allocate %zu bytes\n", hugeSize);
+        exit(1);
+    }
+    huge[0] = 'a';
+    huge[hugeSize - 1] = 'z';
+    eh_free(huge);
+    printf("Large blocks integrity passed.\n");
+}
+
+void test_large_buffer_churn()
+{
+    printf("Testing large buffer churn...\n");
+    char* keepHeapAlive = eh_malloc(6000);
+    assert(keepHeapAlive != NULL);
+    memset(keepHeapAlive, 0x5A, 6000);
+    for (int i = 0; i < 1000; i++)
+    {
+        char* buffer = eh_malloc(8192);
+        char* other = eh_malloc(8192 + (i % 3) * 4096);
+        assert(buffer != NULL && other != NULL && buffer != other);
+        memset(buffer, i, 8192);
+        memset(other, i + 1, 8192);
+        assert(buffer[8191] == (char)i);
+        eh_free(other);
+        eh_free(buffer);
+    }
+    assert(keepHeapAlive[0] == 0x5A && keepHeapAlive[5999] == 0x5A);
+    eh_free(keepHeapAlive);
+    printf("Large buffer churn passed.\n");
+}
+
+//-- BT heap figures are taken from the JSON dump
+static const char* dump_heap_json()
+{
+    const char* path = "/tmp/eh_heaps_test.json";
+    assert(eh_dump_json(path));
+    FILE* file = fopen(path, "r");
+    assert(file != NULL);
+    static char text[1 << 20];
+    size_t      length = fread(text, 1, sizeof(text) - 1, file);
+    fclose(file);
+    unlink(path);
+    text[length] = '\0';
+    return text;
+}
+
+static int count_bt_heaps()
+{
+    const char* text = dump_heap_json();
+    int         count = 0;
+    const char* key = "\"buffer_size\"";
+    for (const char* found = strstr(text, key); found != NULL; found = strstr(found + 1, key))
+    {
+        ++count;
+    }
+    return count;
+}
+
+static size_t bt_retained_bytes()
+{
+    const char* found = strstr(dump_heap_json(), "\"bt_retained_bytes\":");
+    assert(found != NULL);
+    return strtoull(found + strlen("\"bt_retained_bytes\":"), NULL, 10);
+}
+
+void test_reserve()
+{
+    printf("Testing reserve...\n");
+    assert(eh_reserve_slabs(48, 2, EH_RESERVE_POPULATE));
+    assert(eh_reserve_slabs(1024, 1, 0));
+    assert(!eh_reserve_slabs(0, 1, 0));
+    assert(!eh_reserve_slabs(5000, 1, 0));  // served by BT heaps, not by slabs
+    assert(eh_reserve_large(1 << 20, EH_RESERVE_POPULATE));
+    char* small = eh_malloc(48);
+    char* large = eh_malloc(900000);
+    assert(small != NULL && large != NULL);
+    memset(small, 1, 48);
+    memset(large, 2, 900000);
+    eh_free(small);
+    //-- Reserved heap stays mapped and populated when its only block is freed, and it is not
+    //-- moved to the retained list either
+    void*         page = (void*)((uintptr_t)(large) & ~(uintptr_t)(4095));
+    unsigned char resident = 0;
+    size_t        mapped = eh_mapped_bytes();
+    int           heaps = count_bt_heaps();
+    eh_free(large);
+    assert(mincore(page, 4096, &resident) == 0 && (resident & 1));
+    assert(eh_mapped_bytes() == mapped && count_bt_heaps() == heaps);
+    printf("Reserve passed.\n");
+}
+
+static size_t resident_bytes()
+{
+    size_t pages = 0;
+    size_t resident = 0;
+    FILE*  statm = fopen("/proc/self/statm", "r");
+    assert(statm != NULL && fscanf(statm, "%zu %zu", &pages, &resident) == 2);
+    fclose(statm);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+void test_purge()
+{
+    printf("Testing purge...\n");
+    assert(eh_purge_start(40));
+    assert(!eh_purge_start(40));
+
+    enum { smallCount = 100000 };
+    char** small = eh_malloc(smallCount * sizeof(char*));
+    for (int i = 0; i < smallCount; ++i)
+    {
+        small[i] = eh_malloc(64);
+        memset(small[i], i, 64);
+    }
+    char* large = eh_malloc(64 << 20);
+    memset(large, 1, 64 << 20);
+    size_t before = resident_bytes();
+    for (int i = 0; i < smallCount; ++i)
+    {
+        eh_free(small[i]);
+    }
+    eh_free(small);
+    eh_free(large);
+
+    //-- Decay is 40 ms, idle memory has to be gone after a few of them
+    struct timespec pause = {0, 300 * 1000000};
+    nanosleep(&pause, NULL);
+    size_t after = resident_bytes();
+    assert(before > after && before - after >= (size_t)(64 << 20));
+    eh_purge_stop();
+    eh_purge_stop();
+    printf("Purge passed.\n");
+}
+
+static char* ballast = NULL;
+static int   pressure_calls = 0;
+
+static void drop_ballast(size_t needed, void* arg)
+{
+    assert(arg == &ballast && needed > 0);
+    ++pressure_calls;
+    eh_free(ballast);
+    ballast = NULL;
+}
+
+void test_memory_limit()
+{
+    printf("Testing memory limit...\n");
+    size_t chunk = 12 << 20;
+    eh_set_memory_limit(eh_mapped_bytes() + (16 << 20));
+    assert(eh_add_pressure_callback(drop_ballast, &ballast));
+    ballast = eh_malloc(chunk);
+    assert(ballast != NULL);
+    memset(ballast, 1, chunk);
+
+    //-- Second chunk fits only after the callback drops the ballast
+    char* data = eh_malloc(chunk);
+    assert(data != NULL && ballast == NULL && pressure_calls == 1);
+    memset(data, 2, chunk);
+    assert(eh_mapped_bytes() > chunk);
+    assert(eh_malloc(chunk) == NULL && pressure_calls == 2);
+    eh_free(data);
+
+    eh_set_memory_limit(0);
+    data = eh_malloc(chunk * 2);
+    assert(data != NULL);
+    eh_free(data);
+    printf("Memory limit passed.\n");
+}
+
+//-- Limit is met only by purging free pages of a heap which still has a used block
+void test_memory_limit_purge()
+{
+    printf("Testing memory limit purge...\n");
+    eh_trim(0);
+    size_t chunk = 12 << 20;
+    char*  big = eh_malloc(chunk);
+    char*  kept = eh_malloc(3 << 19);
+    assert(big != NULL && kept != NULL);
+    assert(kept > big && kept < big + (16 << 20));
+    memset(big, 1, chunk);
+    memset(kept, 2, 3 << 19);
+    eh_free(big);
+
+    int calls = pressure_calls;
+    eh_set_memory_limit(eh_mapped_bytes() + (4 << 20));
+    char* data = eh_malloc(15 << 20);
+    assert(data != NULL && pressure_calls == calls);
+    memset(data, 3, 15 << 20);
+    assert(kept[0] == 2 && kept[(3 << 19) - 1] == 2);
+    eh_free(data);
+    eh_free(kept);
+    eh_set_memory_limit(0);
+    printf("Memory limit purge passed.\n");
+}
+
+typedef struct SConnection
+{
+    int   m_magic;
+    int   m_uses;
+    char* m_buffer;
+} Connection;
+
+static void connection_ctor(void* object, void* arg)
+{
+    Connection* connection = object;
+    connection->m_magic = 0xC0FFEE;
+    connection->m_uses = 0;
+    connection->m_buffer = eh_malloc(256);
+    ++*(int*)arg;
+}
+
+static void connection_dtor(void* object, void* arg)
+{
+    Connection* connection = object;
+    assert(connection->m_magic == 0xC0FFEE);
+    eh_free(connection->m_buffer);
+    --*(int*)arg;
+}
+
+void test_object_cache()
+{
+    printf("Testing object cache...\n");
+    int    alive = 0;
+    Cache* cache = eh_cache_create(sizeof(Connection), 128, connection_ctor, connection_dtor, &alive);
+    assert(cache != NULL);
+    assert(eh_cache_create(64, 3, NULL, NULL, NULL) == NULL);
+    assert(eh_cache_create(0, 8, NULL, NULL, NULL) == NULL);
+
+    Connection* connections[300];
+    for (int i = 0; i < 300; ++i)
+    {
+        connections[i] = eh_cache_alloc(cache);
+        assert(connections[i] != NULL && (size_t)(connections[i]) % 128 == 0);
+        assert(connections[i]->m_magic == 0xC0FFEE && connections[i]->m_buffer != NULL);
+        ++connections[i]->m_uses;
+    }
+    int constructed = alive;
+    for (int i = 0; i < 300; ++i)
+    {
+        eh_cache_free(cache, connections[i]);
+    }
+    //-- Cached objects keep their state, constructor isn't called again
+    for (int i = 0; i < 300; ++i)
+    {
+        connections[i] = eh_cache_alloc(cache);
+        assert(connections[i]->m_uses == 1);
+    }
+    assert(alive == constructed);
+    for (int i = 0; i < 300; ++i)
+    {
+        eh_cache_free(cache, connections[i]);
+    }
+    eh_cache_shrink(cache);
+    assert(alive == 0);
+    Connection* connection = eh_cache_alloc(cache);
+    assert(connection->m_uses == 0 && alive > 0);
+    eh_cache_free(cache, connection);
+    eh_cache_destroy(cache);
+    assert(alive == 0);
+    printf("Object cache passed.\n");
+}
+
+static void* slabs_worker(void* arg)
+{
+    unsigned int  seed = (unsigned int)(size_t)(arg);
+    unsigned char tag = (unsigned char)(size_t)(arg);
+    enum { slots = 256 };
+    unsigned char* ptrs[slots] = {};
+    size_t         sizes[slots] = {};
+    for (int i = 0; i < 200000; ++i)
+    {
+        int index = rand_r(&seed) % slots;
+        if (ptrs[index] != NULL)
+        {
+            for (size_t j = 0; j < sizes[index]; ++j)
+            {
+                assert(ptrs[index][j] == tag);
+            }
+            eh_free(ptrs[index]);
+            ptrs[index] = NULL;
+        }
+        else
+        {
+            sizes[index] = rand_r(&seed) % 4096 + 1;
+            ptrs[index] = eh_malloc(sizes[index]);
+            assert(ptrs[index] != NULL);
+            memset(ptrs[index], tag, sizes[index]);
+        }
+    }
+    for (int i = 0; i < slots; ++i)
+    {
+        eh_free(ptrs[i]);
+    }
+    return NULL;
+}
+
+void test_threads()
+{
+    printf("Testing threads...\n");
+    pthread_t threads[4];
+    for (size_t i = 0; i < 4; ++i)
+    {
+        assert(pthread_create(&threads[i], NULL, slabs_worker, (void*)(i + 1)) == 0);
+    }
+    for (int i = 0; i < 4; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    printf("Threads passed.\n");
+}
+
+static void* bt_worker(void* arg)
+{
+    unsigned int seed = (unsigned int)(size_t)(arg);
+    char         tag = (char)(size_t)(arg);
+    char*        blocks[32] = {};
+    size_t       sizes[32] = {};
+    for (int i = 0; i < 20000; ++i)
+    {
+        int index = rand_r(&seed) % 32;
+        if (blocks[index] != NULL)
+        {
+            assert(blocks[index][0] == tag && blocks[index][sizes[index] - 1] == tag);
+            eh_free(blocks[index]);
+            blocks[index] = NULL;
+        }
+        else
+        {
+            sizes[index] = 4097 + rand_r(&seed) % (256 << 10);
+            blocks[index] = eh_malloc(sizes[index]);
+            assert(blocks[index] != NULL);
+            blocks[index][0] = blocks[index][sizes[index] - 1] = tag;
+        }
+    }
+    for (int i = 0; i < 32; ++i)
+    {
+        eh_free(blocks[i]);
+    }
+    return NULL;
+}
+
+//-- Slab classes and BT heaps have separate locks, purge thread takes both kinds
+void test_lock_striping()
+{
+    printf("Testing lock striping...\n");
+    assert(eh_purge_start(20));
+    pthread_t threads[4];
+    for (size_t i = 0; i < 4; ++i)
+    {
+        assert(pthread_create(&threads[i], NULL, i % 2 == 0 ? slabs_worker : bt_worker, (void*)(i + 1)) == 0);
+    }
+    for (int i = 0; i < 4; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    eh_purge_stop();
+    printf("Lock striping passed.\n");
+}
+
+static void* inline_worker(void* arg)
+{
+    char* blocks[100];
+    for (int round = 0; round < 100; ++round)
+    {
+        for (int i = 0; i < 100; ++i)
+        {
+            blocks[i] = eh_malloc_inline(200);
+            assert(blocks[i] != NULL);
+            memset(blocks[i], i, 200);
+        }
+        for (int i = 0; i < 100; ++i)
+        {
+            assert(blocks[i][0] == (char)i && blocks[i][199] == (char)i);
+            eh_free_inline(blocks[i], 200);
+        }
+    }
+    return NULL;
+}
+
+//-- Key created after the heap one, so its destructor runs after the thread cache is flushed
+static pthread_key_t late_key;
+static bool          late_free_listed = true;
+
+static void late_destructor(void* block)
+{
+    eh_free_inline(block, 48);
+    late_free_listed = eh_thread_cache.m_counts[0] != 0 || eh_thread_cache.m_registered;
+}
+
+static void* late_free_worker(void* arg)
+{
+    char* block = eh_malloc_inline(48);
+    assert(block != NULL);
+    eh_free_inline(eh_malloc_inline(48), 48);
+    assert(eh_thread_cache.m_registered);
+    pthread_setspecific(late_key, block);
+    return NULL;
+}
+
+//-- Size which doesn't match the owner of the block is ignored, the block is still reused
+void test_free_sized()
+{
+    printf("Testing sized free...\n");
+    char* block = eh_malloc(200);
+    assert(block != NULL);
+    eh_free_sized(block, 200);
+    assert(eh_malloc(200) == block);
+    eh_free_sized(block, 16);
+    assert(eh_malloc(200) == block);
+    eh_free_sized(block, 3000);
+
+    char* large = eh_malloc(100000);
+    assert(large != NULL);
+    eh_free_sized(large, 48);
+    assert(eh_malloc(100000) == large);
+    eh_free_sized(large, 100000);
+    printf("Sized free passed.\n");
+}
+
+void test_inline_fast_path()
+{
+    printf("Testing inline fast path...\n");
+    //-- Freed block is the first one given back for the same class
+    char* small = eh_malloc_inline(48);
+    assert(small != NULL);
+    eh_free_inline(small, 48);
+    assert(eh_malloc_inline(40) == small);
+    eh_free_inline(small, 40);
+
+    char* blocks[3][64];
+    for (int i = 0; i < 64; ++i)
+    {
+        blocks[0][i] = eh_malloc_inline(48);
+        blocks[1][i] = eh_malloc_inline(200);
+        blocks[2][i] = eh_malloc_inline(3000);
+        assert(blocks[0][i] != NULL && blocks[1][i] != NULL && blocks[2][i] != NULL);
+        memset(blocks[0][i], i, 48);
+        memset(blocks[1][i], i, 200);
+        memset(blocks[2][i], i, 3000);
+    }
+    for (int i = 0; i < 64; ++i)
+    {
+        assert(blocks[0][i][47] == (char)i && blocks[1][i][199] == (char)i && blocks[2][i][2999] == (char)i);
+        eh_free_inline(blocks[0][i], 48);
+        eh_free_inline(blocks[1][i], 200);
+        eh_free_inline(blocks[2][i], 3000);
+    }
+    assert(eh_thread_cache.m_counts[2] <= EH_THREAD_CACHE_LENGTH);
+    eh_thread_cache_flush();
+    assert(eh_thread_cache.m_heads[0] == NULL && eh_thread_cache.m_counts[1] == 0);
+
+    //-- Lists of exiting threads go back to caches
+    pthread_t threads[2];
+    for (int i = 0; i < 2; ++i)
+    {
+        assert(pthread_create(&threads[i], NULL, inline_worker, NULL) == 0);
+    }
+    for (int i = 0; i < 2; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    //-- Free from a later destructor goes to the cache, not to the flushed list
+    assert(pthread_key_create(&late_key, late_destructor) == 0);
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, late_free_worker, NULL) == 0);
+    pthread_join(thread, NULL);
+    assert(!late_free_listed);
+    pthread_key_delete(late_key);
+    printf("Inline fast path passed.\n");
+}
+
+void test_trace()
+{
+    printf("Testing trace...\n");
+    void* big = eh_malloc(8 << 20);
+    assert(big != NULL);
+    eh_free(big);
+    const char* path = "/tmp/eh_trace_test.txt";
+    if (!eh_trace_dump(path))
+    {
+        printf("Trace skipped, library is built without tracing.\n");
+        return;
+    }
+    //-- Mapping of the big block has to be there
+    FILE* file = fopen(path, "r");
+    assert(file != NULL);
+    char line[256];
+    bool mapped = false;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        mapped = mapped || strstr(line, " heap_map ") != NULL;
+    }
+    fclose(file);
+    unlink(path);
+    assert(mapped);
+    printf("Trace passed.\n");
+}
+
+typedef struct SPersistentNode
+{
+    struct SPersistentNode* next;
+    size_t                  size;
+    char                    data[];
+} PersistentNode;
+
+void test_persistent_heap()
+{
+    printf("Testing persistent heap...\n");
+    const char* path = "/tmp/eh_persistent_test.heap";
+    void*       base = (void*)(0x3e0000000000ULL);
+    const int   count = 2000;
+    unlink(path);
+
+    PersistentHeap* heap = eh_persistent_open(path, base, 64 << 20);
+    assert(heap != NULL);
+    //-- Second mapping at the same base fails
+    assert(eh_persistent_open(path, base, 0) == NULL);
+    PersistentNode* head = NULL;
+    for (int i = 0; i < count; ++i)
+    {
+        size_t          size = i % 100 == 0 ? 20000 : (size_t)(i % 1000) + 1;
+        PersistentNode* node = eh_persistent_malloc(heap, sizeof(PersistentNode) + size);
+        assert(node != NULL);
+        node->size = size;
+        memset(node->data, i & 0xff, size);
+        node->next = head;
+        head = node;
+    }
+    eh_persistent_set_root(heap, head);
+    eh_persistent_close(heap);
+
+    //-- Structures are found from the root after remapping
+    heap = eh_persistent_open(path, base, 0);
+    assert(heap != NULL);
+    int             index = count - 1;
+    PersistentNode* node = eh_persistent_root(heap);
+    while (node != NULL)
+    {
+        assert(node->size == (index % 100 == 0 ? 20000 : (size_t)(index % 1000) + 1));
+        assert(node->data[0] == (char)(index & 0xff) && node->data[node->size - 1] == (char)(index & 0xff));
+        PersistentNode* next = node->next;
+        eh_persistent_free(heap, node);
+        node = next;
+        --index;
+    }
+    assert(index == -1);
+    void* block = eh_persistent_malloc(heap, 100000);
+    assert(block != NULL);
+    eh_persistent_free(heap, block);
+    eh_persistent_close(heap);
+
+    //-- File has to be mapped at the base it was created with
+    assert(eh_persistent_open(path, (void*)(0x3f0000000000ULL), 0) == NULL);
+    unlink(path);
+    printf("Persistent heap passed.\n");
+}
+
+void test_shared_heap()
+{
+    printf("Testing shared heap...\n");
+    void* base = (void*)(0x3e0000000000ULL);
+    int   fd = memfd_create("eh_shared_test", 0);
+    assert(fd >= 0);
+    PersistentHeap* heap = eh_shared_open(fd, base, 64 << 20);
+    assert(heap != NULL);
+    int pipeFds[2];
+    assert(pipe(pipeFds) == 0);
+
+    pid_t child = fork();
+    assert(child >= 0);
+    if (child == 0)
+    {
+        //-- Maps the heap again as an unrelated process would, then sends messages by pointer
+        eh_persistent_close(heap);
+        heap = eh_shared_open(fd, base, 0);
+        if (heap == NULL)
+        {
+            _exit(1);
+        }
+        for (int i = 0; i < 100; ++i)
+        {
+            size_t size = i % 10 == 0 ? 100000 : (size_t)(i * 37 + 1);
+            char*  message = eh_persistent_malloc(heap, size);
+            if (message == NULL)
+            {
+                _exit(2);
+            }
+            memset(message, i, size);
+            if (write(pipeFds[1], &message, sizeof(message)) != sizeof(message))
+            {
+                _exit(3);
+            }
+        }
+        _exit(0);
+    }
+
+    //-- Parent reads messages in place and frees them
+    for (int i = 0; i < 100; ++i)
+    {
+        char* message = NULL;
+        assert(read(pipeFds[0], &message, sizeof(message)) == sizeof(message));
+        size_t size = i % 10 == 0 ? 100000 : (size_t)(i * 37 + 1);
+        assert(message[0] == (char)(i) && message[size - 1] == (char)(i));
+        eh_persistent_free(heap, message);
+    }
+    int status = 0;
+    assert(waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    void* block = eh_persistent_malloc(heap, 48);
+    assert(block != NULL);
+    eh_persistent_free(heap, block);
+
+    //-- Lock left by a dead process is taken over, alarm turns a hang into a failure
+    child = fork();
+    assert(child >= 0);
+    if (child == 0)
+    {
+        pthread_mutex_lock(&heap->m_lock);
+        _exit(0);
+    }
+    assert(waitpid(child, &status, 0) == child && WIFEXITED(status));
+    alarm(10);
+    block = eh_persistent_malloc(heap, 100000);
+    assert(block != NULL);
+    eh_persistent_free(heap, block);
+    alarm(0);
+    eh_persistent_close(heap);
+    close(pipeFds[0]);
+    close(pipeFds[1]);
+    close(fd);
+    printf("Shared heap passed.\n");
+}
+
+void test_dump_json()
+{
+    printf("Testing JSON dump...\n");
+    void* small = eh_malloc(32);
+    void* big = eh_malloc(100000);
+    assert(small != NULL && big != NULL);
+    const char* path = "/tmp/eh_dump_test.json";
+    assert(eh_dump_json(path));
+    eh_free(small);
+    eh_free(big);
+
+    FILE* file = fopen(path, "r");
+    assert(file != NULL);
+    char   text[65536];
+    size_t length = fread(text, 1, sizeof(text) - 1, file);
+    fclose(file);
+    unlink(path);
+    text[length] = '\0';
+    assert(text[0] == '{' && strstr(text, "\"caches\"") != NULL && strstr(text, "\"bt_heaps\"") != NULL);
+    assert(strstr(text, "\"object_size\": 64") != NULL && strstr(text, "\"bt_fragmentation\"") != NULL);
+    int depth = 0;
+    for (size_t i = 0; i < length; ++i)
+    {
+        depth += (text[i] == '{' || text[i] == '[') - (text[i] == '}' || text[i] == ']');
+        assert(depth >= 0);
+    }
+    assert(depth == 0);
+    printf("JSON dump passed.\n");
+}
+
+void test_trim()
+{
+    printf("Testing trim...\n");
+    char* blocks[30];
+    for (int i = 0; i < 30; ++i)
+    {
+        blocks[i] = eh_malloc(20000);
+        assert(blocks[i] != NULL);
+        memset(blocks[i], i, 20000);
+    }
+    void* small[5000];
+    for (int i = 0; i < 5000; ++i)
+    {
+        small[i] = eh_malloc(48);
+        assert(small[i] != NULL);
+    }
+    for (int i = 0; i < 5000; ++i)
+    {
+        eh_free(small[i]);
+    }
+    for (int i = 0; i < 30; ++i)
+    {
+        eh_free(blocks[i]);
+    }
+    //-- Free keeps the last BT heap and an empty slab, trim gives them back
+    size_t mapped = eh_mapped_bytes();
+    size_t trimmed = eh_trim(0);
+    assert(trimmed >= 100000);
+    assert(eh_mapped_bytes() == mapped - trimmed);
+    assert(eh_trim((size_t)(-1)) == 0);
+
+    //-- Free pages around used block are purged, the block stays intact. Blocks don't fit
+    //-- the reserved heap, which is never trimmed
+    enum { keptSize = 3 << 19, freedSize = 2 << 20 };
+    char* kept = eh_malloc(keptSize);
+    char* freed = eh_malloc(freedSize);
+    assert(kept != NULL && freed != NULL);
+    memset(kept, 7, keptSize);
+    memset(freed, 8, freedSize);
+    eh_free(freed);
+    mapped = eh_mapped_bytes();
+    trimmed = eh_trim(0);
+    size_t purged = eh_mapped_bytes();
+    assert(purged < mapped && trimmed == mapped - purged);
+    assert(kept[0] == 7 && kept[keptSize - 1] == 7);
+    //-- Reused purged pages count as mapped again
+    freed = eh_malloc(freedSize);
+    assert(freed != NULL);
+    memset(freed, 8, freedSize);
+    assert(eh_mapped_bytes() == mapped);
+    eh_free(freed);
+    eh_free(kept);
+    printf("Trim passed.\n");
+}
+
+void test_adaptive_slab_order()
+{
+    printf("Testing adaptive slab order...\n");
+    const int count = 100000;
+    Cache*    cache = eh_cache_create(64, 64, NULL, NULL, NULL);
+    char**    objects = malloc(count * sizeof(char*));
+    assert(cache != NULL && objects != NULL);
+    //-- Slots of one slab are taken in address order, a run longer than the first slab
+    //-- means slabs grew
+    size_t run = 1, longestRun = 1;
+    for (int i = 0; i < count; ++i)
+    {
+        objects[i] = eh_cache_alloc(cache);
+        assert(objects[i] != NULL);
+        memset(objects[i], i & 0xff, 64);
+        run = i > 0 && objects[i] == objects[i - 1] + 64 ? run + 1 : 1;
+        longestRun = run > longestRun ? run : longestRun;
+    }
+    assert(longestRun * 64 > 64 * 1024);
+
+    //-- Slabs of different sizes are freed and reused together
+    for (int i = 0; i < count; i += 2)
+    {
+        assert(objects[i][0] == (char)(i & 0xff) && objects[i][63] == (char)(i & 0xff));
+        eh_cache_free(cache, objects[i]);
+    }
+    for (int i = 0; i < count; i += 2)
+    {
+        objects[i] = eh_cache_alloc(cache);
+        assert(objects[i] != NULL);
+        memset(objects[i], i & 0xff, 64);
+    }
+    for (int i = 0; i < count; ++i)
+    {
+        assert(objects[i][0] == (char)(i & 0xff) && objects[i][63] == (char)(i & 0xff));
+        eh_cache_free(cache, objects[i]);
+    }
+    eh_cache_shrink(cache);
+    objects[0] = eh_cache_alloc(cache);
+    assert(objects[0] != NULL);
+    eh_cache_free(cache, objects[0]);
+    eh_cache_destroy(cache);
+    free(objects);
+    printf("Adaptive slab order passed.\n");
+}
+
+void test_retained_mappings()
+{
+    printf("Testing retained mappings...\n");
+    size_t sizes[] = {64 << 10, 1 << 20, 3 << 20, 8 << 20};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+    {
+        char* buffer = eh_malloc(sizes[i]);
+        assert(buffer != NULL);
+        memset(buffer, 1, sizes[i]);
+        size_t mapped = eh_mapped_bytes();
+        eh_free(buffer);
+        //-- Heap of the buffer stays committed and serves the next buffer of the same size
+        assert(eh_mapped_bytes() == mapped);
+        for (int j = 0; j < 100; ++j)
+        {
+            buffer = eh_malloc(sizes[i]);
+            assert(buffer != NULL);
+            buffer[0] = buffer[sizes[i] - 1] = (char)j;
+            assert(eh_mapped_bytes() == mapped);
+            eh_free(buffer);
+        }
+    }
+    //-- Much smaller request doesn't take a big retained heap. It doesn't fit the reserved heap
+    //-- either, so it needs a heap of its own
+    eh_trim(0);
+    char* large = eh_malloc(8 << 20);
+    assert(large != NULL);
+    memset(large, 1, 8 << 20);
+    eh_free(large);
+    size_t retained = bt_retained_bytes();
+    assert(retained >= (8 << 20));
+    char* small = eh_malloc(2 << 20);
+    assert(small != NULL);
+    assert(bt_retained_bytes() == retained);
+    eh_free(small);
+
+    size_t mapped = eh_mapped_bytes();
+    assert(eh_trim(0) >= (8 << 20));
+    assert(eh_mapped_bytes() <= mapped - (8 << 20));
+    printf("Retained mappings passed.\n");
+}
+
+typedef struct SCompactNode
+{
+    CompactHandle m_next;
+    int           m_value;
+} CompactNode;
+
+typedef struct SPointerNode
+{
+    struct SPointerNode* m_next;
+    int                  m_value;
+} PointerNode;
+
+void test_compact_heap()
+{
+    printf("Testing compact heap...\n");
+    PersistentHeap* heap = eh_compact_create();
+    assert(heap != NULL);
+    assert(eh_compact_malloc(heap, 0) == 0 && eh_compact_ptr(heap, 0) == NULL);
+
+    //-- List with 32 bit links, 8 byte nodes go to the 8 byte class and commit well below pointer linked ones
+    size_t        committedBefore = spaceCommitted(&heap->m_space);
+    CompactHandle head = 0;
+    for (int i = 0; i < 100000; ++i)
+    {
+        CompactHandle handle = eh_compact_malloc(heap, sizeof(CompactNode));
+        assert(handle != 0);
+        CompactNode* node = eh_compact_ptr(heap, handle);
+        assert(eh_compact_handle(heap, node) == handle);
+        node->m_next = head;
+        node->m_value = i;
+        head = handle;
+    }
+    int expected = 99999;
+    for (CompactHandle handle = head; handle != 0; --expected)
+    {
+        CompactNode* node = eh_compact_ptr(heap, handle);
+        assert(node->m_value == expected);
+        handle = node->m_next;
+    }
+    assert(expected == -1);
+    size_t listBytes = spaceCommitted(&heap->m_space) - committedBefore;
+    assert(listBytes < 100000 * sizeof(PointerNode) * 3 / 4);
+
+    //-- Large blocks go to BT heaps of the same range
+    CompactHandle large = eh_compact_malloc(heap, 3 << 20);
+    assert(large != 0);
+    memset(eh_compact_ptr(heap, large), 0x3C, 3 << 20);
+    eh_compact_free(heap, large);
+
+    while (head != 0)
+    {
+        CompactHandle next = ((CompactNode*)eh_compact_ptr(heap, head))->m_next;
+        eh_compact_free(heap, head);
+        head = next;
+    }
+    eh_compact_destroy(heap);
+    printf("Compact heap passed.\n");
+}
+
+void test_bt_heap_growth()
+{
+    printf("Testing BT heap growth...\n");
+    enum { blocksCount = 2000, blockSize = 20000 };
+    int    heapsBefore = count_bt_heaps();
+    char** blocks = malloc(blocksCount * sizeof(char*));
+    assert(blocks != NULL);
+    for (int i = 0; i < blocksCount; ++i)
+    {
+        blocks[i] = eh_malloc(blockSize);
+        assert(blocks[i] != NULL);
+        memset(blocks[i], i & 0xff, blockSize);
+    }
+    //-- 40 MB of blocks would take about 300 heaps of the initial size
+    assert(count_bt_heaps() - heapsBefore < 30);
+    for (int i = 0; i < blocksCount; ++i)
+    {
+        assert(blocks[i][0] == (char)(i & 0xff) && blocks[i][blockSize - 1] == (char)(i & 0xff));
+        eh_free(blocks[i]);
+    }
+    free(blocks);
+    printf("BT heap growth passed.\n");
+}
+
 void speed_compare()
 {
     {  //-- Cache speed test
@@ -334,8 +1341,59 @@ void speed_compare()
     }
 }
 
-int main()
+//-- Runs in a fresh process whose limit doesn't fit the reserved range, so spans are mapped one by one
+static int run_low_address_limit()
 {
+    size_t sizes[] = {16, 200, 3000, 100000, 3 << 20};
+    char*  blocks[5];
+    for (int round = 0; round < 2; ++round)
+    {
+        for (int i = 0; i < 5; ++i)
+        {
+            blocks[i] = eh_malloc(sizes[i]);
+            if (blocks[i] == NULL)
+            {
+                return 1;
+            }
+            memset(blocks[i], i + 1, sizes[i]);
+        }
+        for (int i = 0; i < 5; ++i)
+        {
+            if (blocks[i][0] != i + 1 || blocks[i][sizes[i] - 1] != i + 1)
+            {
+                return 2;
+            }
+            eh_free(blocks[i]);
+        }
+    }
+    return 0;
+}
+
+void test_low_address_limit()
+{
+    printf("Testing low address limit...\n");
+#ifndef __SANITIZE_ADDRESS__
+    pid_t child = fork();
+    assert(child >= 0);
+    if (child == 0)
+    {
+        struct rlimit limit = {900000 << 10, 900000 << 10};
+        setrlimit(RLIMIT_AS, &limit);
+        execl("/proc/self/exe", "test", "--low-address-limit", (char*)(NULL));
+        _exit(3);
+    }
+    int status = 0;
+    assert(waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+#endif
+    printf("Low address limit passed.\n");
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1 && strcmp(argv[1], "--low-address-limit") == 0)
+    {
+        return run_low_address_limit();
+    }
     //-- Chat GPT generated tests
     test_basic_allocation();
     test_data_integrity();
@@ -352,6 +1410,29 @@ int main()
     test_deallocation_of_null_pointer();
     test_deallocation_of_unallocated_memory();
     test_large_complex_allocation_and_data_integrity();
+    test_bt_best_fit();
+    test_slab_slots_reuse();
+    test_large_blocks_integrity();
+    test_large_buffer_churn();
+    test_reserve();
+    test_threads();
+    test_object_cache();
+    test_purge();
+    test_memory_limit();
+    test_memory_limit_purge();
+    test_inline_fast_path();
+    test_free_sized();
+    test_trace();
+    test_persistent_heap();
+    test_shared_heap();
+    test_dump_json();
+    test_trim();
+    test_adaptive_slab_order();
+    test_retained_mappings();
+    test_compact_heap();
+    test_lock_striping();
+    test_bt_heap_growth();
+    test_low_address_limit();
     speed_compare();
     printf("All tests completed.\n");
     dumpHeap();